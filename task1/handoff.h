@@ -0,0 +1,38 @@
+/*
+ * handoff.h - Hot upgrades of the stock servers
+ *
+ * A server started with -u <path> listens for a successor on that Unix
+ * socket. Starting the same server again with the same path makes the new
+ * process connect there. The old process stops as it would on SIGTERM,
+ * except that it stops trading at once: its cutover function waits until
+ * no trade is under way, commits the journal and copies the stocks. The
+ * listening sockets (as SCM_RIGHTS) and the stocks go to the successor,
+ * which starts serving right away, while the old process only writes out
+ * the replies it already has. From the cutover on stock.txt and the
+ * journal are the successor's, so the old process never checkpoints
+ * again. The port stays bound throughout, so clients that connect during
+ * the cutover wait in the backlog rather than being refused.
+ */
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include "stockproto.h"
+
+#define HANDOFF_MAXFDS 256 /* Listening sockets a handoff may carry */
+
+/* Connect to the server on path, if any; returns the socket, or -1 */
+int handoff_connect(char *path);
+
+/* Wait on path for a successor, who stops the server and gets fds and the
+ * stocks cutover returns */
+void handoff_listen(char *path, int *fds, int nfds,
+                    bin_stock *(*cutover)(int *count, unsigned **version));
+
+/* Take the listeners and stocks from s; NULL if the predecessor gave none */
+bin_stock *handoff_recv(int s, int *fds, int *nfds, int *count,
+                        unsigned **version);
+
+/* Wait until the successor that stopped the server has the stocks */
+void handoff_finish(void);
+
+#endif /* __HANDOFF_H__ */
@@ -1,4 +1,5 @@
 #include "csapp.h"
+#include "stockproto.h"
 #include <time.h>
 
 #define MAX_CLIENT 100
@@ -6,14 +7,18 @@
 #define STOCK_NUM 10
 #define BUY_SELL_MAX 10
 
+ssize_t read_reply(rio_t *rp, char *buf, int framed); /* Read one reply */
+ssize_t read_binary(rio_t *rp, char *buf); /* Read one binary reply as text */
 
 int main(int argc, char **argv) 
 {
 	pid_t pids[MAX_CLIENT];
 	int runprocess = 0, status, i;
 
-	int clientfd, num_client;
-	char *host, *port, buf[MAXLINE], tmp[3];
+	int clientfd, num_client, opt, framed = 0, binary = 0, depth = 1;
+	int queued;
+	size_t outlen;
+	char *host, *port, buf[MAXLINE], out[MAXLINE], tmp[3];
 	rio_t rio;
 
   struct timeval start, end;
@@ -21,14 +26,29 @@ int main(int argc, char **argv)
 
   gettimeofday(&start, NULL);
 
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s <host> <port> <client#>\n", argv[0]);
+	/* -f: negotiate length-framed replies instead of MAXLINE padding */
+	/* -b: speak the binary protocol instead of text */
+	/* -p: pipeline up to depth orders before reading their replies */
+	while ((opt = getopt(argc, argv, "fbp:")) != -1) {
+		if (opt == 'f')
+			framed = 1;
+		else if (opt == 'b')
+			binary = 1;
+		else if (opt == 'p' && (depth = atoi(optarg)) >= 1 &&
+			 depth <= ORDER_PER_CLIENT)
+			;
+		else
+			optind = argc;
+	}
+
+	if (argc - optind != 3) {
+		fprintf(stderr, "usage: %s [-f|-b] [-p depth] <host> <port> <client#>\n", argv[0]);
 		exit(0);
 	}
 
-	host = argv[1];
-	port = argv[2];
-	num_client = atoi(argv[3]);
+	host = argv[optind];
+	port = argv[optind + 1];
+	num_client = atoi(argv[optind + 2]);
 
 /*	fork for each client process	*/
 	while(runprocess < num_client){
@@ -45,14 +65,29 @@ int main(int argc, char **argv)
 			Rio_readinitb(&rio, clientfd);
 			srand((unsigned int) getpid());
 
+			if(binary){
+				buf[0] = (char)PROTO_BINARY;
+				Rio_writen(clientfd, buf, 1);
+			}
+			else if(framed){
+				sprintf(buf, "%s\n", PROTO_FRAMED);
+				Rio_writen(clientfd, buf, strlen(buf));
+				read_reply(&rio, buf, framed);
+			}
+
+			queued = 0;
+			outlen = 0;
 			for(i=0;i<ORDER_PER_CLIENT;i++){
 				//int option = rand() % 3;
 				int option = 0; // SHOW only
 				//int option = rand() % 2; // BUY & SHOW
 				//int option = rand() % 2 + 1; // SELL & BUY
-				
+				bin_req req;
+
+				memset(&req, 0, sizeof(bin_req));
 				if(option == 0){//show
 					strcpy(buf, "show\n");
+					req.op = OP_SHOW;
 				}
 				else if(option == 1){//buy
 					int list_num = rand() % STOCK_NUM + 1;
@@ -65,6 +100,9 @@ int main(int argc, char **argv)
 					sprintf(tmp, "%d", num_to_buy);
 					strcat(buf, tmp);
 					strcat(buf, "\n");
+					req.op = OP_BUY;
+					req.id = htonl(list_num);
+					req.qty = htonl(num_to_buy);
 				}
 				else if(option == 2){//sell
 					int list_num = rand() % STOCK_NUM + 1; 
@@ -77,13 +115,34 @@ int main(int argc, char **argv)
 					sprintf(tmp, "%d", num_to_sell);
 					strcat(buf, tmp);
 					strcat(buf, "\n");
+					req.op = OP_SELL;
+					req.id = htonl(list_num);
+					req.qty = htonl(num_to_sell);
 				}
 				//strcpy(buf, "buy 1 2\n");
 			
-				Rio_writen(clientfd, buf, strlen(buf));
-				// Rio_readlineb(&rio, buf, MAXLINE);
-				Rio_readnb(&rio, buf, MAXLINE);
-				Fputs(buf, stdout);
+				/* Queue the order; a full batch goes out in one write */
+				if(binary){
+					memcpy(out + outlen, &req, sizeof(bin_req));
+					outlen += sizeof(bin_req);
+				}
+				else{
+					memcpy(out + outlen, buf, strlen(buf));
+					outlen += strlen(buf);
+				}
+				if(++queued < depth && i + 1 < ORDER_PER_CLIENT)
+					continue;
+				Rio_writen(clientfd, out, outlen);
+				outlen = 0;
+
+				for(; queued > 0; queued--){
+					if(binary)
+						read_binary(&rio, buf);
+					else
+						// Rio_readlineb(&rio, buf, MAXLINE);
+						read_reply(&rio, buf, framed);
+					Fputs(buf, stdout);
+				}
 
 				usleep(1000000);
 			}
@@ -124,3 +183,65 @@ int main(int argc, char **argv)
 
 	return 0;
 }
+
+/*
+ * read_reply - Read one reply into buf, which has room for MAXLINE bytes:
+ * a whole MAXLINE-padded block, or the payload of a framed reply, which is
+ * then NUL-terminated. Of a longer framed reply only the whole lines in
+ * its first MAXLINE-1 bytes are kept. Returns the number of payload bytes, 0 on EOF.
+ */
+ssize_t read_reply(rio_t *rp, char *buf, int framed)
+{
+	char hdr[PROTO_FRAMEHDR], rest[MAXLINE], *cut;
+	size_t len, kept, n;
+
+	if(!framed)
+		return Rio_readnb(rp, buf, MAXLINE);
+
+	if(Rio_readlineb(rp, hdr, PROTO_FRAMEHDR) == 0)
+		return 0;
+	len = strtoul(hdr, NULL, 10);
+	kept = len < MAXLINE ? len : MAXLINE - 1;
+	if(Rio_readnb(rp, buf, kept) != kept)
+		return 0;
+	buf[kept] = '\0';
+	if(kept < len && (cut = strrchr(buf, '\n')) != NULL)
+		cut[1] = '\0'; /* keep whole lines only */
+	for(; kept < len; kept += n){
+		n = len - kept < MAXLINE ? len - kept : MAXLINE;
+		if(Rio_readnb(rp, rest, n) != n)
+			return 0;
+	}
+	return len;
+}
+
+/*
+ * read_binary - Read one binary reply and render it into buf, which has room
+ * for MAXLINE bytes, the way the text protocol would have answered.
+ */
+ssize_t read_binary(rio_t *rp, char *buf)
+{
+	bin_reply reply;
+	bin_stock rec;
+	uint32_t i, count;
+	size_t n = 0;
+
+	if(Rio_readnb(rp, &reply, sizeof(bin_reply)) != sizeof(bin_reply))
+		return 0;
+	count = ntohl(reply.count);
+	buf[0] = '\0';
+	for(i = 0; i < count; i++){
+		if(Rio_readnb(rp, &rec, sizeof(bin_stock)) != sizeof(bin_stock))
+			return 0;
+		if(n + 40 < MAXLINE)
+			n += sprintf(buf + n, "%u %u %u\n", ntohl(rec.id),
+				     ntohl(rec.left), ntohl(rec.price));
+	}
+	if(reply.op == OP_BUY)
+		n = sprintf(buf, reply.status == BIN_OK ? "[buy] success\n"
+			    : "Not enough left stocks\n");
+	else if(reply.op == OP_SELL)
+		n = sprintf(buf, reply.status == BIN_OK ? "[sell] success\n"
+			    : "[sell] fail\n");
+	return n;
+}
@@ -0,0 +1,27 @@
+/*
+ * rcu.h - Read-copy-update reclamation for the stock servers
+ *
+ * Readers bracket their use of shared structures with rcu_read_lock and
+ * rcu_read_unlock, which take no lock and write only to the calling
+ * thread's own record. A writer never changes what readers can see in
+ * place: it publishes a new copy, hands the old pieces to rcu_retire and
+ * calls rcu_synchronize, which waits until every read section that could
+ * still hold them has ended and then frees them. Read sections nest, and
+ * must not call rcu_synchronize themselves.
+ */
+#ifndef __RCU_H__
+#define __RCU_H__
+
+/* Enter a read section; the calling thread registers on first use */
+void rcu_read_lock(void);
+
+/* Leave the read section entered last */
+void rcu_read_unlock(void);
+
+/* Free p once every read section running now has ended */
+void rcu_retire(void *p);
+
+/* Wait for every read section running now, then free what was retired */
+void rcu_synchronize(void);
+
+#endif /* __RCU_H__ */
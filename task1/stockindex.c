@@ -0,0 +1,142 @@
+/*
+ * stockindex.c - Flat index from stock ID to item (see stockindex.h)
+ */
+#include "csapp.h"
+#include "stockindex.h"
+
+static void hash_alloc(stock_index *ix, unsigned size); /* Empty table */
+static void hash_grow(stock_index *ix); /* Doubles the table */
+
+/* Return the kind named "tree", "hash", "direct" or "auto"; -2 if none */
+int index_kind(char *name) {
+  if (!strcmp(name, "auto"))
+    return INDEX_AUTO;
+  if (!strcmp(name, "tree"))
+    return INDEX_TREE;
+  if (!strcmp(name, "hash"))
+    return INDEX_HASH;
+  if (!strcmp(name, "direct"))
+    return INDEX_DIRECT;
+  return -2;
+}
+
+/* Return the name of a kind for messages */
+char *index_name(int kind) {
+  switch (kind) {
+  case INDEX_TREE:
+    return "tree";
+  case INDEX_HASH:
+    return "hash";
+  case INDEX_DIRECT:
+    return "direct";
+  default:
+    return "auto";
+  }
+}
+
+/*
+ * index_init - Make an empty index of kind for n stocks with IDs in
+ * lo..hi. INDEX_AUTO maps the IDs directly while their range is at most
+ * INDEX_DENSITY slots per stock and hashes them otherwise.
+ */
+void index_init(stock_index *ix, int kind, int n, int lo, int hi) {
+  long range = n > 0 ? (long)hi - lo + 1 : 1;
+  unsigned size = 16;
+
+  if (kind == INDEX_AUTO)
+    kind = range <= (long)INDEX_DENSITY * n + 16 && range <= INDEX_DIRECT_MAX
+               ? INDEX_DIRECT
+               : INDEX_HASH;
+  memset(ix, 0, sizeof(stock_index));
+  ix->kind = kind;
+  if (kind == INDEX_DIRECT) {
+    if (range > INDEX_DIRECT_MAX)
+      app_error("stock IDs too sparse for a direct index");
+    ix->lo = n > 0 ? lo : 0;
+    ix->size = range;
+    ix->direct = Calloc(range, sizeof(void *));
+  } else if (kind == INDEX_HASH) {
+    while (size < 2 * (unsigned)n) /* at most half full */
+      size *= 2;
+    hash_alloc(ix, size);
+  }
+}
+
+/* Map id to item, replacing any item it had */
+void index_insert(stock_index *ix, int id, void *item) {
+  unsigned i;
+
+  if (ix->kind == INDEX_DIRECT) {
+    if (id < ix->lo || (unsigned)(id - ix->lo) >= ix->size)
+      app_error("stock ID outside the direct index");
+    ix->direct[id - ix->lo] = item;
+  } else if (ix->kind == INDEX_HASH) {
+    if (2 * (ix->count + 1) > ix->size)
+      hash_grow(ix);
+    i = ((unsigned)id * 2654435769u) >> ix->shift;
+    while (ix->slots[i].item != NULL && ix->slots[i].id != id)
+      i = (i + 1) & (ix->size - 1);
+    if (ix->slots[i].item == NULL)
+      ix->count++;
+    ix->slots[i].id = id;
+    ix->slots[i].item = item;
+  }
+}
+
+/*
+ * index_find - Return the item of id, or NULL if the index has none. A
+ * hash probe starts at the Fibonacci hash of id and ends at id or at the
+ * first empty slot; the table is never over half full.
+ */
+void *index_find(stock_index *ix, int id) {
+  unsigned i;
+
+  if (ix->kind == INDEX_DIRECT) {
+    if (id < ix->lo || (unsigned)(id - ix->lo) >= ix->size)
+      return NULL;
+    return ix->direct[id - ix->lo];
+  }
+  if (ix->kind != INDEX_HASH)
+    return NULL;
+  i = ((unsigned)id * 2654435769u) >> ix->shift;
+  while (ix->slots[i].item != NULL) {
+    if (ix->slots[i].id == id)
+      return ix->slots[i].item;
+    i = (i + 1) & (ix->size - 1);
+  }
+  return NULL;
+}
+
+/* Hand the tables of ix to release, which frees them now or later */
+void index_free(stock_index *ix, void (*release)(void *)) {
+  if (ix->slots != NULL)
+    release(ix->slots);
+  if (ix->direct != NULL)
+    release(ix->direct);
+  ix->slots = NULL;
+  ix->direct = NULL;
+}
+
+/* Give ix an empty hash table of size slots, a power of two */
+static void hash_alloc(stock_index *ix, unsigned size) {
+  int bits = 0;
+
+  while ((1u << bits) < size)
+    bits++;
+  ix->size = size;
+  ix->count = 0;
+  ix->shift = 32 - bits;
+  ix->slots = Calloc(size, sizeof(index_slot));
+}
+
+/* Double the hash table of ix and reinsert its items */
+static void hash_grow(stock_index *ix) {
+  index_slot *old = ix->slots;
+  unsigned size = ix->size;
+
+  hash_alloc(ix, 2 * size);
+  for (unsigned i = 0; i < size; i++)
+    if (old[i].item != NULL)
+      index_insert(ix, old[i].id, old[i].item);
+  Free(old);
+}
@@ -0,0 +1,54 @@
+/*
+ * stockindex.h - Flat index from stock ID to item for the stock servers
+ *
+ * The AVL tree keeps the stocks in ID order, but a lookup in it takes two
+ * dependent loads per level. The index answers the lookups of trades
+ * instead. A direct index is an array of item pointers covering the ID
+ * range. A hash index is an open-addressing table with linear probing
+ * whose slots hold each ID next to its item, so a probe usually touches
+ * one cache line. Items are stored as void *, so both servers can use it.
+ */
+#ifndef __STOCKINDEX_H__
+#define __STOCKINDEX_H__
+
+#define INDEX_AUTO -1  /* Direct if the IDs are dense enough, else hash */
+#define INDEX_TREE 0   /* No index: lookups walk the AVL tree */
+#define INDEX_HASH 1   /* Open-addressing hash table */
+#define INDEX_DIRECT 2 /* Array indexed by ID */
+#define INDEX_DENSITY 2 /* Max ID range per stock INDEX_AUTO maps directly */
+#define INDEX_DIRECT_MAX (1 << 26) /* Max ID range of a direct index */
+
+typedef struct {
+  int id;     /* Stock ID */
+  void *item; /* Its item; NULL while the slot is empty */
+} index_slot;
+
+typedef struct {
+  int kind;          /* INDEX_TREE, INDEX_HASH or INDEX_DIRECT */
+  int lo;            /* Smallest ID a direct index covers */
+  unsigned size;     /* Slots; a power of two for a hash */
+  unsigned count;    /* Items inserted into a hash */
+  int shift;         /* 32 - log2(size), for the hash function */
+  index_slot *slots; /* Slots of a hash */
+  void **direct;     /* Slots of a direct index: item of ID lo + i */
+} stock_index;
+
+/* Return the kind named "tree", "hash", "direct" or "auto"; -2 if none */
+int index_kind(char *name);
+
+/* Return the name of a kind for messages */
+char *index_name(int kind);
+
+/* Make an empty index of kind for n stocks with IDs in lo..hi */
+void index_init(stock_index *ix, int kind, int n, int lo, int hi);
+
+/* Map id to item, replacing any item it had */
+void index_insert(stock_index *ix, int id, void *item);
+
+/* Return the item of id, or NULL if the index has none */
+void *index_find(stock_index *ix, int id);
+
+/* Hand the tables of ix to release, which frees them now or later */
+void index_free(stock_index *ix, void (*release)(void *));
+
+#endif /* __STOCKINDEX_H__ */
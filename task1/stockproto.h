@@ -0,0 +1,63 @@
+/*
+ * stockproto.h - Wire protocol shared by the stock server and its clients
+ */
+#ifndef __STOCKPROTO_H__
+#define __STOCKPROTO_H__
+
+#include <stdint.h>
+
+/*
+ * Replies are MAXLINE bytes, NUL-padded, unless the client opens with this
+ * request line. The server then acknowledges with a framed "ok\n" and every
+ * later reply is framed: the payload size in decimal and a newline, followed
+ * by exactly that many payload bytes.
+ */
+#define PROTO_FRAMED "framed"
+#define PROTO_FRAMEHDR 16 /* Room for a frame header */
+
+/*
+ * A connection whose very first byte is PROTO_BINARY speaks the binary
+ * protocol instead: fixed-size bin_req requests, each answered by a
+ * bin_reply header followed by count bin_stock records. Every integer is
+ * in network byte order. Text requests always start with a letter, so the
+ * handshake byte can never be mistaken for one.
+ */
+#define PROTO_BINARY 0xB5
+
+/* Binary request opcodes */
+#define OP_SHOW 1 /* Snapshot of the whole table */
+#define OP_BUY 2  /* Buy qty stocks of id */
+#define OP_SELL 3 /* Sell qty stocks of id */
+#define OP_EXIT 4 /* Acknowledged; the client then closes */
+#define OP_RANGE 5 /* Stocks with IDs id..qty, in ID order */
+#define OP_TOP 6   /* The id stocks ranking highest by key qty, best first */
+
+/* Ranking keys of OP_TOP, as the text request "top <n> price|stock" */
+#define TOP_PRICE 0 /* Highest price */
+#define TOP_STOCK 1 /* Most stocks left */
+
+/* Binary reply status */
+#define BIN_OK 0   /* Request carried out */
+#define BIN_FAIL 1 /* Unknown stock or not enough left */
+
+typedef struct {
+  uint8_t op;     /* OP_* */
+  uint8_t pad[3]; /* Zero */
+  uint32_t id;    /* Stock ID of buy/sell, lowest ID of range, n of top */
+  uint32_t qty;   /* Quantity of buy/sell, highest ID of range, top key */
+} bin_req;
+
+typedef struct {
+  uint8_t op;     /* Opcode being answered */
+  uint8_t status; /* BIN_OK or BIN_FAIL */
+  uint8_t pad[2]; /* Zero */
+  uint32_t count; /* Number of bin_stock records that follow */
+} bin_reply;
+
+typedef struct {
+  uint32_t id;    /* Stock ID */
+  uint32_t left;  /* The number of stocks left in the market */
+  uint32_t price; /* The price of this stock */
+} bin_stock;
+
+#endif /* __STOCKPROTO_H__ */
@@ -1,16 +1,93 @@
 #include "csapp.h"
-#define STOCK_NUM 10 /* The number of stock IDs in the stock server */
+#include "stockproto.h"
+#include "journal.h"
+#include "stockindex.h"
+#include "rcu.h"
+#include "affinity.h"
+#include "stop.h"
+#include "handoff.h"
+#ifdef __linux__
+#include "uring.h"
+#endif
+#define MAXEVENTS 1024 /* Max ready descriptors handled per epoll_wait */
+#define MAXPENDING (16 * MAXLINE) /* Queued reply bytes that pause reading */
+#define SHOW_LINE 37 /* Longest "id left price\n" show line and its NUL */
+#define DRAIN_TICK_MS 10 /* How often a stopping loop looks at the clock */
+#define DRAIN_FORCE_MS 1000 /* Wait for replies after the clients are cut */
 #define max(a, b) ((a > b) ? a : b) /* Macro for comparison */
+#define min(a, b) ((a < b) ? a : b) /* Macro for comparison */
+
+/* I/O multiplexing backends for the pool */
+#define POOL_SELECT 0 /* select(2) over fd_sets, capped at FD_SETSIZE */
+#define POOL_EPOLL 1  /* Edge-triggered epoll(7), no descriptor cap */
+#define POOL_URING 2  /* io_uring(7) completions, one system call per loop */
+
+/* io_uring requests of the pool; user_data holds the descriptor and kind */
+#define URING_ENTRIES 4096 /* Submission entries per ring */
+#define URING_BUFS 256     /* Provided receive buffers per ring */
+#define URING_ACCEPT 0     /* Multishot accept on the listener */
+#define URING_RECV 1       /* Receive into a provided buffer */
+#define URING_SEND 2       /* Send of replies while more requests wait */
+#define URING_LINKED 3     /* Send with the next receive linked behind it */
+#define URING_STOP 4       /* Poll of the stop pipe */
+#define URING_TICK 5       /* Timeout of a stopping loop */
+#define URING_CANCEL 6     /* Cancellation of the accept */
+#define URING_COMMIT 7     /* Poll of the journal's commit pipe */
+#define URING_DATA(fd, kind) ((unsigned long long)(fd) << 3 | (kind))
+
+/* State of one non-blocking client connection */
+typedef struct {
+  rio_t rio;   /* Read buffer; unparsed bytes start at rio.rio_bufptr */
+  char *wbuf;  /* Replies the socket has not accepted yet */
+  size_t wlen; /* Bytes queued in wbuf */
+  size_t woff; /* Bytes of wbuf already written */
+  size_t wcap; /* Allocated size of wbuf */
+  int framed;  /* Replies are length-framed instead of MAXLINE-padded */
+  int binary;  /* Speaks the binary protocol of stockproto.h */
+  int greeted; /* The first byte, which selects the protocol, was seen */
+  char *in;    /* Received bytes not copied to rio yet, with io_uring */
+  int inlen;   /* Length of in */
+  int bid;     /* Provided buffer in points into */
+  unsigned long seq; /* Journal record of its last trade */
+  int parked;  /* Its replies wait in the pool for that record's commit */
+  int starved; /* Its receive waits in the pool for a provided buffer */
+  unsigned long recvgen; /* Buffers the pool had recycled at its receive */
+} client_t;
 
 /* a pool of connected descriptors */
 typedef struct {
-  int maxfd;                   /* Largest Descriptor in read_set */
-  fd_set read_set;             /* Set of all active descriptors */
-  fd_set ready_set;            /* Subset of descriptors ready for reading */
-  int nready;                  /* Number of descriptors ready from select */
-  int maxi;                    /* High water index to client aray */
-  int clientfd[FD_SETSIZE];    /* Set of active file descriptors */
-  rio_t clientrio[FD_SETSIZE]; /* Set of active read buffers */
+  int backend;        /* POOL_SELECT, POOL_EPOLL or POOL_URING */
+  int listenfd;       /* Listening descriptor; -1 once stopping */
+  int stopfd;         /* Readable once SIGINT or SIGTERM arrived */
+  int commitfd;       /* Readable after each journal commit */
+  int *parked;        /* Slots of clients whose replies wait for a commit */
+  int nparked;        /* Entries of parked; some may be stale */
+  int parkcap;        /* Entries allocated for parked */
+  int nclients;       /* Clients connected */
+  int stopping;       /* Draining: no accepts, clients served until gone */
+  long deadline;      /* stop_clock time the clients are cut at */
+  int cut;            /* Sides of the clients shut down: 0, SHUT_RD + 1 or
+                         SHUT_RDWR + 1 */
+  int maxfd;          /* Largest Descriptor in read_set */
+  fd_set read_set;    /* Set of descriptors we want to read from */
+  fd_set write_set;   /* Set of descriptors with replies pending */
+  fd_set ready_set;   /* Subset of descriptors ready for reading */
+  fd_set ready_wset;  /* Subset of descriptors ready for writing */
+  int nready;         /* Number of descriptors ready from select */
+  int maxi;           /* High water index to client aray */
+  int size;           /* Number of slots in clientfd and clients */
+  int *clientfd;      /* Set of active file descriptors */
+  client_t **clients; /* Set of active connection states */
+#ifdef __linux__
+  int epfd;                             /* epoll instance */
+  struct epoll_event events[MAXEVENTS]; /* Ready list from epoll_wait */
+  uring_t ring;                         /* io_uring instance */
+  unsigned long recycled; /* Provided buffers given back so far */
+  int *starved;   /* Clients whose receive found no buffer, oldest first */
+  int starvehead; /* First entry of starved still waiting */
+  int nstarved;   /* Entries of starved; some may be stale */
+  int starvecap;  /* Entries allocated for starved */
+#endif
 } pool;
 
 typedef struct {
@@ -21,118 +98,457 @@ typedef struct {
   sem_t mutex;    /* Semaphore for safe writing */
 } item;
 
+/* Pre-rendered show replies, grown as stocks are listed */
+typedef struct {
+  unsigned long version; /* Table version the rendering shows */
+  char *text;            /* Text reply: "id left price" per stock */
+  size_t len;            /* Length of text */
+  bin_stock *recs;       /* Binary reply records in network order */
+  int count;             /* Number of records */
+  int cap;               /* Stocks text and recs have room for */
+} snapshot_t;
+
+/*
+ * Nodes are never changed once readers can reach them: an update copies
+ * the nodes it changes, and gen tells the copies it already made.
+ */
 typedef struct node {
   item *stock;        /* The stock */
   struct node *left;  /* The left subtree of this node */
   struct node *right; /* The right subtree of this node */
   int height;         /* Height of the subtree */
+  int size;           /* Number of stocks in the subtree */
+  unsigned gen;       /* Update that made the node */
 } node;
 
-void init_pool(int listenfd,
+/*
+ * One version of the stock universe. Reactors use the published one inside
+ * an RCU read section; list and delist build the next beside it.
+ */
+typedef struct {
+  node *tree;        /* AVL tree of the stocks by ID */
+  int count;         /* Number of stocks */
+  item **order;      /* The stocks in the order they were listed */
+  item **by_price;   /* The stocks, highest price first */
+  stock_index index; /* ID lookups of trades, unless a tree kind */
+} universe_t;
+
+void *reactor(void *vargp); /* Runs one event loop on its own listener */
+int reuses_port(int listenfd); /* Tells if more listeners may join one */
+void init_pool(int listenfd, int backend,
                pool *p); /* Initializes the pool of active clients */
 void add_client(int connfd,
                 pool *p);    /* Adds a new client connection to the pool */
+void remove_client(int i, pool *p); /* Closes a client and frees its slot */
+void wait_clients(pool *p);  /* Blocks until some descriptor is ready */
+void accept_clients(pool *p); /* Accepts every pending connection */
 void check_clients(pool *p); /* Services client connections */
+void check_events(pool *p);  /* Services the epoll ready list */
+void begin_drain(pool *p);    /* Stops accepting and starts the deadline */
+void check_deadline(pool *p); /* Cuts the clients once it has passed */
+void serve_client(int i, pool *p); /* Advances a client's state machine */
+void park_client(int i, pool *p); /* Holds replies until their commit */
+void release_clients(pool *p); /* Serves the clients a commit released */
+int answer_one(client_t *c);  /* Answers the first buffered request */
+void serve_uring(pool *p);    /* Runs the loop of an io_uring pool */
+void uring_serve(int fd, pool *p); /* Answers a client, then sends */
+void uring_receive(int fd, pool *p); /* Queues a receive for a client */
+void uring_starve(int fd, pool *p); /* Holds a receive until a buffer is free */
+void uring_refill(unsigned bid, pool *p); /* Gives a buffer to the kernel */
+
+void client_send(client_t *c, const char *buf,
+                 size_t len);       /* Queues raw bytes for the client */
+void client_reply(client_t *c, char *buf,
+                  size_t len);      /* Queues one reply in the client's format */
+int client_flush(client_t *c);      /* Writes queued replies */
+void handle_request(client_t *c, char *buf); /* Answers one request line */
+void handle_binary(client_t *c,
+                   bin_req *req);   /* Answers one binary request */
+int read_stock(item *s);            /* Reads an item under the readers lock */
+void init_snapshot(void);           /* Allocates the show renderings */
+char *show_text(size_t *len);       /* Copies the cached show reply */
+bin_stock *show_binary(int *count); /* Copies the cached show records */
+bin_stock *query_stocks(int op, int a, int b,
+                        int *count); /* Collects a range or a top list */
+char *render_stocks(bin_stock *rec, int n,
+                    size_t *len);   /* Renders records as a show reply */
+universe_t *make_universe(node *tree, item **order,
+                          int count); /* Indexes a new version */
+void publish(universe_t *next);     /* Replaces the universe */
+int list_stock(int id, int left, int price); /* Adds a stock at runtime */
+int delist_stock(int id);           /* Removes a stock at runtime */
+int buy_stock(int id, int stock,
+              unsigned long *seq); /* Buys shares if enough are left */
+int sell_stock(int id, int stock,
+               unsigned long *seq); /* Sells shares back to the market */
+void save_stocks(void);             /* Checkpoints the table to stock.txt */
+void free_stocks(void);             /* Frees the universe and its stocks */
+bin_stock *read_stocks(int *count); /* Parses stock.txt */
+bin_stock *copy_stocks(int *count); /* Copies the published stocks */
+bin_stock *cutover(int *count,
+                   unsigned **version); /* Stops trading for a successor */
+void apply_record(int id, int left,
+                  unsigned version); /* Replays one journal record */
 
 node *left_rotate(node *x);  /* Rotate the tree to the left */
 node *right_rotate(node *y); /* Rotate the tree to the right */
 int get_balance(node *n);    /* Check the balance of the tree */
 int height(node *n);         /* Get the height of the tree */
+int tree_size(node *n);      /* Get the number of stocks in the tree */
+void update_node(node *n);   /* Recompute height and size from children */
 
 node *insert_stock(node *tree, int id, int left_stock,
-                   int price);         /* Insert the node into the tree */
-void delete_stock(node *tree, int id); /* Delete the node from the tree */
+                   int price);          /* Insert the node into the tree */
+node *delete_stock(node *tree, int id); /* Delete the node from the tree */
+static node *fresh(node *n);   /* Make a node safe for the update to change */
+static void discard(node *n);  /* Free a node the update took out */
+static void free_tree(node *n); /* Free every node of a tree */
+static node *rebalance(node *n); /* Restore the AVL balance at a node */
 item *query_stock(node *tree, int id); /* Find a specific node from the tree */
+item *find_stock(int id); /* Find a stock through the index or the tree */
+int count_below(node *tree, long id); /* Count the stocks under an ID */
+int range_stocks(node *tree, int lo, int hi,
+                 bin_stock *rec); /* Collect the stocks of lo..hi */
 
 static sem_t mutex;      /* semaphore for reading */
-node *stock_tree = NULL; /* The stock tree */
-item *order[STOCK_NUM] = {
-    NULL,
-}; /* The array to preserve the stock number */
+static universe_t *universe; /* The stocks reactors see */
+static sem_t admin_mutex;    /* Serializes list and delist */
+static sem_t save_mutex;     /* Serializes checkpoints */
+static unsigned tree_gen;    /* Update the tree is going through */
+static int index_choice = INDEX_AUTO; /* Index kind asked for with -i */
+#ifdef __linux__
+static int backend = POOL_EPOLL; /* I/O multiplexing backend of every pool */
+#else
+static int backend = POOL_SELECT; /* I/O multiplexing backend of every pool */
+#endif
+static int nreactors = 1; /* The number of event loops serving clients */
+static int *listenfds;    /* Listening descriptor of each reactor */
+static cpu_list reactor_cpus; /* Cores the reactors are spread over */
+static int stopfd;        /* Readable once SIGINT or SIGTERM arrived */
+static int drain_ms = DRAIN_MS; /* Time clients get once the server stops */
+static sem_t reactors_done; /* Posted by each reactor as it returns */
+static sem_t reactors_cut;  /* Posted by each reactor once it stops trading */
+static char *upgrade_path; /* Unix socket of hot upgrades, if any */
+static sem_t snap_mutex; /* Protects snap */
+static snapshot_t snap;  /* Latest rendering of the show reply */
+static unsigned long table_version = 1; /* Bumped by every trade */
 
 int main(int argc, char **argv) {
-  int listenfd, connfd;
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr; /* Enough space for any address */
-  static pool pool;
-  char client_hostname[MAXLINE], client_port[MAXLINE], status[MAXLINE];
-  char *stateptr;
-  int id, stock, price, n;
-  FILE *fp;
+  int opt, i, s, nfds = 0, count, nstocks = 0, taken;
+  int fds[HANDOFF_MAXFDS];
+  pthread_t tid;
+  bin_stock *rec = NULL;
+  struct timespec start, end;
+  node *tree = NULL;
+  item **order;
+  int commit_ms = JOURNAL_COMMIT_MS, checkpoint_s = JOURNAL_CHECKPOINT_S;
+  int dirty_max = JOURNAL_DIRTY_MAX;
+
+  // Choose the I/O backend, the number of event loops and the journal pace
+  while ((opt = getopt(argc, argv, "b:r:a:i:j:c:d:g:u:")) != -1) {
+    if (opt == 'b' && !strcmp(optarg, "select")) {
+      backend = POOL_SELECT;
+#ifdef __linux__
+    } else if (opt == 'b' && !strcmp(optarg, "epoll")) {
+      backend = POOL_EPOLL;
+    } else if (opt == 'b' && !strcmp(optarg, "uring")) {
+      backend = POOL_URING;
+#endif
+    } else if (opt == 'r' && (nreactors = atoi(optarg)) >= 0) {
+      if (nreactors == 0) /* one event loop per online core */
+        nreactors = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    } else if (opt == 'a' && affinity_parse(optarg, &reactor_cpus)) {
+      /* one reactor per core of the list, round it if there are more */
+    } else if (opt == 'i' && (index_choice = index_kind(optarg)) != -2) {
+      /* how trades find their stock */
+    } else if (opt == 'j' && (commit_ms = atoi(optarg)) >= 0) {
+      /* 0 commits as soon as the last commit is done */
+    } else if (opt == 'c' && (checkpoint_s = atoi(optarg)) >= 0) {
+      /* 0 leaves checkpoints to the dirty count */
+    } else if (opt == 'd' && (dirty_max = atoi(optarg)) >= 0) {
+      /* 0 leaves checkpoints to the timer */
+    } else if (opt == 'g' && (drain_ms = atoi(optarg)) >= 0) {
+      /* grace the clients get once SIGINT or SIGTERM arrives */
+    } else if (opt == 'u') {
+      upgrade_path = optarg; /* take over from the server there, if any */
+    } else {
+      optind = argc; /* force the usage message */
+      break;
+    }
+  }
 
   // When we execute stockserver, we need another argument named port.
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  if (argc - optind != 1) {
+    fprintf(stderr,
+            "usage: %s [-b select|epoll|uring] [-r reactors] "
+            "[-a cpus|irq:name] [-i auto|tree|hash|direct] [-j commit_ms] "
+            "[-c checkpoint_s] [-d dirty_max] [-g drain_ms] "
+            "[-u upgrade_sock] <port>\n",
+            argv[0]);
     exit(0);
   }
 
-  // Open a file descriptor(port) and wait for request
-  listenfd = Open_listenfd(argv[1]);
-  init_pool(listenfd, &pool);
+  // Before any thread, so that all of them leave the signals to stop_init
+  stopfd = stop_init();
 
-  // open the file with stock data
-  fp = Fopen("stock.txt", "r");
-  // read stock table
-  n = 0;
-  while (Fgets(status, MAXLINE, fp) != NULL) {
-    id = atoi(strtok_r(status, " ", &stateptr));
-    stock = atoi(strtok_r(NULL, " ", &stateptr));
-    price = atoi(strtok_r(NULL, " ", &stateptr));
-    stock_tree = insert_stock(stock_tree, id, stock, price);
-    order[n++] = query_stock(stock_tree, id);
-    memset(status, '\0', MAXLINE);
+  // A predecessor hands over its listeners and stocks as soon as it has
+  // stopped trading; the port stays bound meanwhile
+  if (upgrade_path != NULL && (s = handoff_connect(upgrade_path)) >= 0) {
+    printf("taking over from the server on %s\n", upgrade_path);
+    fflush(stdout);
+    rec = handoff_recv(s, fds, &nfds, &count, NULL);
   }
-  Fclose(fp);
+  taken = rec != NULL;
 
-  while (1) {
-    // int Select(int  n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
-    // struct timeval *timeout)
-    pool.ready_set = pool.read_set;
-    pool.nready = Select(pool.maxfd + 1, &pool.ready_set, NULL, NULL, NULL);
+  // Open a file descriptor(port) per reactor, unless one was handed over;
+  // every listener handed over gets a reactor, lest its backlog be lost.
+  // Listeners without SO_REUSEPORT cannot be joined by more of them, so
+  // they get just one reactor each
+  if (nfds > 0 && !reuses_port(fds[0]) && nreactors != nfds) {
+    printf("running %d reactors, as the listeners lack SO_REUSEPORT\n", nfds);
+    nreactors = nfds;
+  }
+  nreactors = max(nreactors, nfds);
+  listenfds = Malloc(nreactors * sizeof(int));
+  for (i = 0; i < nreactors; i++) {
+    if (i < nfds)
+      listenfds[i] = fds[i];
+    else if (nreactors > 1)
+      listenfds[i] = Open_listenfd_reuseport(argv[optind]);
+    else
+      listenfds[i] = Open_listenfd(argv[optind]);
+  }
+
+  Sem_init(&mutex, 0, 1);
+  Sem_init(&snap_mutex, 0, 1);
+  Sem_init(&admin_mutex, 0, 1);
+  Sem_init(&save_mutex, 0, 1);
+  Sem_init(&reactors_done, 0, 0);
+  Sem_init(&reactors_cut, 0, 0);
+
+  // Take the stocks of the predecessor, else those of stock.txt
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (!taken)
+    rec = read_stocks(&count);
+  order = Malloc(max(count, 1) * sizeof(item *));
+  for (i = 0; i < count; i++) {
+    tree = insert_stock(tree, rec[i].id, rec[i].left, rec[i].price);
+    if (tree_size(tree) > nstocks) /* a repeated ID only updates its stock */
+      order[nstocks++] = query_stock(tree, rec[i].id);
+  }
+  Free(rec);
+
+  // Index the stocks for the lookups of trades
+  universe = make_universe(tree, order, nstocks);
+
+  // Trades since the last checkpoint are in the journal, unless the stocks
+  // of the predecessor hold them already
+  if (!taken)
+    journal_replay(apply_record);
+  init_snapshot();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("loaded %d stocks in %.1f ms, %s index\n", nstocks,
+         (end.tv_sec - start.tv_sec) * 1e3 +
+             (end.tv_nsec - start.tv_nsec) / 1e6,
+         index_name(universe->index.kind));
+  journal_open(commit_ms, checkpoint_s, dirty_max, save_stocks);
+  if (upgrade_path != NULL)
+    handoff_listen(upgrade_path, listenfds, nreactors, cutover);
+
+  // Every extra event loop gets its own thread; main runs the last one
+  for (i = 0; i < nreactors - 1; i++) {
+    Pthread_create(&tid, NULL, reactor, (void *)(long)i);
+  }
+  reactor((void *)(long)(nreactors - 1));
+
+  // Every loop has let its clients go: write the table a last time, unless
+  // it went to a successor, whose stock.txt and journal they are now
+  for (i = 0; i < nreactors; i++)
+    P(&reactors_done);
+  if (stop_successor() >= 0) {
+    handoff_finish();
+    printf("stopped\n");
+    exit(0);
+  }
+  journal_flush();
+  save_stocks();
+  free_stocks();
+  printf("stopped\n");
+  exit(0);
+}
+
+/*
+ * reactor - One event loop with a private listening socket and pool;
+ * vargp is its number. With several reactors each listener binds the port
+ * with SO_REUSEPORT so the kernel shards new connections between them; the
+ * stock tree is shared. A reactor pins itself before it allocates its
+ * pool, which thus lands on the memory node of its core. Once the server
+ * stops it no longer accepts and serves its clients until they leave or
+ * the drain deadline has passed.
+ */
+void *reactor(void *vargp) {
+  int self = (int)(long)vargp;
+  pool *p;
+
+  if (nreactors > 1)
+    Pthread_detach(Pthread_self());
+  affinity_pin_one(&reactor_cpus, self);
+  p = Malloc(sizeof(pool));
+
+  // Wait for request on the listener of this reactor
+  init_pool(listenfds[self], backend, p);
+  if (p->backend == POOL_URING)
+    serve_uring(p);
+
+  while (p->backend != POOL_URING && (!p->stopping || p->nclients > 0)) {
+    wait_clients(p);
+    if (!p->stopping && stop_requested())
+      begin_drain(p);
+    check_deadline(p);
+
+    if (p->backend == POOL_EPOLL) {
+      check_events(p);
+      continue;
+    }
+
+    if (FD_ISSET(p->commitfd, &p->ready_set)) {
+      p->nready--;
+      release_clients(p);
+    }
 
     // If listenfd is set in the ready set of the descriptor pool, we are ready
     // to establish a connection via listenfd.
-    if (FD_ISSET(listenfd, &pool.ready_set)) {
-      // Accept the new client and establish the connection
-      clientlen = sizeof(struct sockaddr_storage);
-      connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-      add_client(connfd, &pool);
+    if (p->listenfd >= 0 && FD_ISSET(p->listenfd, &p->ready_set)) {
+      accept_clients(p);
     }
 
-    check_clients(&pool);
+    check_clients(p);
   }
+  V(&reactors_done);
+  return NULL;
+}
 
-  // delete the stock tree
-  while (stock_tree->left != NULL || stock_tree->right != NULL) {
-    if (stock_tree->left != NULL) {
-      delete_stock(stock_tree, stock_tree->left->stock->ID);
-    } else if (stock_tree->right != NULL) {
-      delete_stock(stock_tree, stock_tree->right->stock->ID);
-    }
-  }
+/* Return 1 if more listeners may bind the port of listenfd (SO_REUSEPORT) */
+int reuses_port(int listenfd) {
+  int on = 0;
+  socklen_t len = sizeof(on);
 
-  exit(0);
+#ifdef SO_REUSEPORT
+  if (getsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, &len) < 0)
+    unix_error("getsockopt error");
+#endif
+  return on;
 }
 
-void init_pool(int listenfd, pool *p) {
+void init_pool(int listenfd, int backend, pool *p) {
   int i;
-  Sem_init(&mutex, 0, 1);
+  p->backend = backend;
+  p->listenfd = listenfd;
+  p->stopfd = stopfd;
+  p->commitfd = journal_notify();
+  p->parked = NULL;
+  p->nparked = p->parkcap = 0;
+  p->nclients = 0;
+  p->stopping = 0;
+  p->cut = 0;
   p->maxi = -1;
-  for (i = 0; i < FD_SETSIZE; i++) {
+  /* select can never watch more than FD_SETSIZE descriptors, while epoll
+   * and io_uring slots are indexed by descriptor and grow in add_client */
+  p->size = (backend == POOL_SELECT) ? FD_SETSIZE : 64;
+  p->clientfd = Malloc(p->size * sizeof(int));
+  p->clients = Calloc(p->size, sizeof(client_t *));
+  for (i = 0; i < p->size; i++) {
     p->clientfd[i] = -1;
   }
-  p->maxfd = listenfd;
+  p->maxfd = max(max(listenfd, stopfd), p->commitfd);
   FD_ZERO(&p->read_set);
+  FD_ZERO(&p->write_set);
   FD_SET(listenfd, &p->read_set);
+  FD_SET(stopfd, &p->read_set);
+  FD_SET(p->commitfd, &p->read_set);
+
+#ifdef __linux__
+  if (backend == POOL_EPOLL) {
+    struct epoll_event ev;
+
+    /* The listener is drained with accept until EAGAIN, so it must not block */
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+    p->epfd = Epoll_create1(0);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listenfd;
+    Epoll_ctl(p->epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    /* Level-triggered: every reactor's instance sees the pipe */
+    ev.events = EPOLLIN;
+    ev.data.fd = stopfd;
+    Epoll_ctl(p->epfd, EPOLL_CTL_ADD, stopfd, &ev);
+    ev.data.fd = p->commitfd;
+    Epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->commitfd, &ev);
+  }
+  if (backend == POOL_URING) {
+    /* One accept request stands for every client to come */
+    uring_init(&p->ring, URING_ENTRIES);
+    uring_provide(&p->ring, URING_BUFS, RIO_BUFSIZE);
+    p->recycled = 0;
+    p->starved = NULL;
+    p->starvehead = p->nstarved = p->starvecap = 0;
+    uring_accept(&p->ring, listenfd, URING_DATA(listenfd, URING_ACCEPT));
+    uring_poll(&p->ring, stopfd, URING_DATA(stopfd, URING_STOP));
+    uring_poll(&p->ring, p->commitfd, URING_DATA(p->commitfd, URING_COMMIT));
+  }
+#endif
 }
 
 void add_client(int connfd, pool *p) {
   int i;
+  client_t *c;
+
+  /* A client must never block the loop, whatever the backend */
+  fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+  c = Calloc(1, sizeof(client_t));
+  Rio_readinitb(&c->rio, connfd);
+  p->nclients++;
+
+  if (p->backend != POOL_SELECT) {
+#ifdef __linux__
+    struct epoll_event ev;
+
+    /* The kernel hands out the lowest free descriptor, so indexing by connfd
+     * keeps the arrays dense without a free-slot search */
+    if (connfd >= p->size) {
+      int size = p->size;
+      while (size <= connfd)
+        size *= 2;
+      p->clientfd = Realloc(p->clientfd, size * sizeof(int));
+      p->clients = Realloc(p->clients, size * sizeof(client_t *));
+      for (i = p->size; i < size; i++) {
+        p->clientfd[i] = -1;
+        p->clients[i] = NULL;
+      }
+      p->size = size;
+    }
+    p->clientfd[connfd] = connfd;
+    p->clients[connfd] = c;
+    if (connfd > p->maxi)
+      p->maxi = connfd;
+
+    if (p->backend == POOL_URING) {
+      uring_receive(connfd, p);
+      return;
+    }
+
+    /* Both directions are armed once; edges only fire on state changes */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = connfd;
+    Epoll_ctl(p->epfd, EPOLL_CTL_ADD, connfd, &ev);
+#endif
+    return;
+  }
+
   p->nready--;
-  for (i = 0; i < FD_SETSIZE; i++) {
+  for (i = 0; i < p->size; i++) {
     if (p->clientfd[i] < 0) {
       p->clientfd[i] = connfd;
-      Rio_readinitb(&p->clientrio[i], connfd);
+      p->clients[i] = c;
 
       FD_SET(connfd, &p->read_set);
 
@@ -144,139 +560,1271 @@ void add_client(int connfd, pool *p) {
     }
   }
 
-  if (i == FD_SETSIZE) {
+  if (i == p->size) {
     app_error("Too many clients");
   }
 }
 
+void remove_client(int i, pool *p) {
+  int connfd = p->clientfd[i];
+
+  /* Closing the descriptor also drops it from the epoll interest list */
+  Close(connfd);
+  if (p->backend == POOL_SELECT) {
+    FD_CLR(connfd, &p->read_set);
+    FD_CLR(connfd, &p->write_set);
+  }
+#ifdef __linux__
+  if (p->clients[i]->in != NULL)
+    uring_refill(p->clients[i]->bid, p);
+#endif
+  Free(p->clients[i]->wbuf);
+  Free(p->clients[i]);
+  p->clients[i] = NULL;
+  p->clientfd[i] = -1;
+  p->nclients--;
+}
+
+/*
+ * begin_drain - Stop accepting once the server stops. The clients are
+ * still served until drain_ms from now. A successor gets the listener,
+ * which is thus left open; otherwise it is closed, so that new clients
+ * are refused. For a successor the reactor has stopped trading, which it
+ * reports to the cutover, and the reading side of its clients is shut at
+ * once: they only get the replies they have, and send the rest of their
+ * requests to the successor.
+ */
+void begin_drain(pool *p) {
+  int successor = stop_successor() >= 0;
+
+  p->stopping = 1;
+  p->deadline = stop_clock() + drain_ms;
+  if (successor) {
+    p->cut = SHUT_RD + 1;
+    for (int i = 0; i <= p->maxi; i++)
+      if (p->clientfd[i] >= 0)
+        shutdown(p->clientfd[i], SHUT_RD);
+    V(&reactors_cut);
+  }
+  if (p->backend == POOL_SELECT) {
+    FD_CLR(p->listenfd, &p->read_set);
+    FD_CLR(p->stopfd, &p->read_set);
+  }
+#ifdef __linux__
+  if (p->backend == POOL_EPOLL) {
+    Epoll_ctl(p->epfd, EPOLL_CTL_DEL, p->listenfd, NULL);
+    Epoll_ctl(p->epfd, EPOLL_CTL_DEL, p->stopfd, NULL);
+  }
+  if (p->backend == POOL_URING) {
+    uring_cancel(&p->ring, URING_DATA(p->listenfd, URING_ACCEPT),
+                 URING_DATA(0, URING_CANCEL));
+    uring_timeout(&p->ring, DRAIN_TICK_MS, URING_DATA(0, URING_TICK));
+  }
+#endif
+  if (!successor)
+    Close(p->listenfd);
+  p->listenfd = -1;
+}
+
+/*
+ * check_deadline - Once the deadline of a stopping pool has passed, shut
+ * down the reading side of every client still connected: each one reads
+ * EOF after the requests it sent, whose replies still go out. Clients not
+ * gone DRAIN_FORCE_MS later are shut down for writing too. Either way the
+ * loop removes them the usual way, which also waits out any request the
+ * kernel still holds a client's buffers for.
+ */
+void check_deadline(pool *p) {
+  int how;
+
+  if (!p->stopping || p->cut == SHUT_RDWR + 1)
+    return;
+  if (stop_clock() < p->deadline + (p->cut ? DRAIN_FORCE_MS : 0))
+    return;
+  how = p->cut ? SHUT_RDWR : SHUT_RD;
+  p->cut = how + 1;
+  for (int i = 0; i <= p->maxi; i++)
+    if (p->clientfd[i] >= 0)
+      shutdown(p->clientfd[i], how);
+}
+
+void wait_clients(pool *p) {
+  /* A stopping pool wakes up now and then to look at its deadline */
+  struct timeval tick = {0, DRAIN_TICK_MS * 1000};
+
+#ifdef __linux__
+  if (p->backend == POOL_EPOLL) {
+    p->nready = Epoll_wait(p->epfd, p->events, MAXEVENTS,
+                           p->stopping ? DRAIN_TICK_MS : -1);
+    return;
+  }
+#endif
+  // int Select(int  n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+  // struct timeval *timeout)
+  p->ready_set = p->read_set;
+  p->ready_wset = p->write_set;
+  p->nready = Select(p->maxfd + 1, &p->ready_set, &p->ready_wset, NULL,
+                     p->stopping ? &tick : NULL);
+}
+
+void accept_clients(pool *p) {
+  int connfd;
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr; /* Enough space for any address */
+
+  if (p->backend == POOL_SELECT) {
+    // Accept the new client and establish the connection
+    clientlen = sizeof(struct sockaddr_storage);
+    connfd = Accept(p->listenfd, (SA *)&clientaddr, &clientlen);
+    add_client(connfd, p);
+    return;
+  }
+
+  /* Edge-triggered: one wakeup may stand for many queued connections */
+  while (1) {
+    clientlen = sizeof(struct sockaddr_storage);
+    if ((connfd = accept(p->listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "Accept error: %s\n", strerror(errno));
+      break;
+    }
+    add_client(connfd, p);
+  }
+}
+
 void check_clients(pool *p) {
-  int i, connfd, n;
-  int id, stock, price;
-  char buf[MAXLINE] =
-      {
-          '\0',
-      },
-       status[MAXLINE] =
-           {
-               '\0',
-           },
-       result[MAXLINE] = {
-           '\0',
-       };
-  char *comp[3] =
-      {
-          NULL,
-      },
-       *stateptr;
-  rio_t *rio;
-  FILE *fp;
+  int i, connfd, ready;
 
   for (i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
     connfd = p->clientfd[i];
-    rio = &p->clientrio[i];
-    if ((connfd > 0) && FD_ISSET(connfd, &p->ready_set)) {
-      p->nready--;
-      if ((n = Rio_readlineb(rio, buf, MAXLINE)) != 0) {
-
-        printf("server received %d bytes\n", n);
-        
-        /* Parse the line from the client */
-        comp[0] = strtok_r(buf, " \n", &stateptr);
-        for (int x = 1; x < 3; x++) {
-          comp[x] = strtok_r(NULL, " \n", &stateptr);
-        }
+    if (connfd < 0)
+      continue;
+    ready = FD_ISSET(connfd, &p->ready_set) + FD_ISSET(connfd, &p->ready_wset);
+    if (ready) {
+      p->nready -= ready;
+      serve_client(i, p);
+    }
+  }
+}
 
-        /* Do the appropriate action based on the parsed line */
-        if (!strcmp(comp[0], "show")) {
-          /* show the stock data */
-          memset(result, '\0', MAXLINE);
-          for (int i = 0; i < STOCK_NUM; i++) {
-            if (order[i]) {
-              order[i]->read_cnt++;
-              sprintf(status, "%d %d %d\n", order[i]->ID, order[i]->left_stock,
-                      order[i]->price);
-              strcat(result, status);
-              order[i]->read_cnt--;
-            }
-          }
-          Rio_writen(connfd, result, MAXLINE);
-        } else if (!strcmp(comp[0], "buy")) {
-          id = atoi(comp[1]);
-          stock = atoi(comp[2]);
-          item *stock_item = query_stock(stock_tree, id);
-          if (stock_item == NULL || stock_item->left_stock < stock) {
-            sprintf(status, "Not enough left stocks\n");
-            Rio_writen(connfd, status, MAXLINE);
-          } else {
-            stock_item->left_stock -= stock;
-            sprintf(status, "[buy] success\n");
-            Rio_writen(connfd, status, MAXLINE);
-          }
-        } else if (!strcmp(comp[0], "sell")) {
-          id = atoi(comp[1]);
-          stock = atoi(comp[2]);
-          item *stock_item = query_stock(stock_tree, id);
-          if (stock_item == NULL) {
-            sprintf(status, "[sell] fail\n");
-            Rio_writen(connfd, status, MAXLINE);
-          } else {
-            stock_item->left_stock += stock;
-            sprintf(status, "[sell] success\n");
-            Rio_writen(connfd, status, MAXLINE);
-          }
-        } else if (!strcmp(comp[0], "exit")) {
-          sprintf(status, "exit\n");
-          Rio_writen(connfd, status, MAXLINE);
-          break;
+void check_events(pool *p) {
+#ifdef __linux__
+  int i, connfd;
+
+  /* Only the descriptors that became ready are visited, never the pool */
+  for (i = 0; i < p->nready; i++) {
+    connfd = p->events[i].data.fd;
+    if (connfd == p->stopfd)
+      continue; /* the reactor saw it already */
+    if (connfd == p->commitfd)
+      release_clients(p);
+    else if (connfd == p->listenfd)
+      accept_clients(p);
+    else if (p->clientfd[connfd] >= 0)
+      serve_client(connfd, p);
+  }
+#endif
+}
+
+/*
+ * serve_client - Advance the state machine of the client in slot i: flush
+ * pending replies, then read and answer every complete request line the
+ * socket has, until it would block. A partial line stays in the read buffer
+ * for the next wakeup, and reading pauses while too many replies are
+ * queued, so neither a slow sender nor a slow reader holds up the loop.
+ * Replies to a pipelined batch are only queued while it is parsed and then
+ * leave in a single write, once the journal has committed its trades; till
+ * then the client is parked.
+ */
+void serve_client(int i, pool *p) {
+  client_t *c = p->clients[i];
+  int n, eof = 0;
+
+  if (client_flush(c) < 0) {
+    remove_client(i, p);
+    return;
+  }
+
+  while (1) {
+    if (c->wlen - c->woff >= MAXPENDING) {
+      if (client_flush(c) < 0) {
+        eof = 1;
+        break;
+      }
+      if (c->wlen - c->woff >= MAXPENDING)
+        break;
+    }
+
+    /* Answer every complete request already in the buffer */
+    if (answer_one(c))
+      continue;
+    if (eof)
+      break;
+
+    /* Make room behind the partial line and read whatever has arrived */
+    if (c->rio.rio_bufptr != c->rio.rio_buf) {
+      memmove(c->rio.rio_buf, c->rio.rio_bufptr, c->rio.rio_cnt);
+      c->rio.rio_bufptr = c->rio.rio_buf;
+    }
+    if (c->rio.rio_cnt == RIO_BUFSIZE) {
+      /* A line longer than the buffer is cut, as Rio_readlineb would */
+      c->rio.rio_buf[RIO_BUFSIZE - 1] = '\n';
+      continue;
+    }
+    n = read(c->rio.rio_fd, c->rio.rio_buf + c->rio.rio_cnt,
+             RIO_BUFSIZE - c->rio.rio_cnt);
+    if (n > 0) {
+      c->rio.rio_cnt += n;
+    } else if (n == 0) {
+      eof = 1;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      eof = 1;
+    }
+  }
+
+  /* A client that shut its end still gets the replies to what it sent */
+  if (client_flush(c) < 0 || (eof && c->wlen == c->woff)) {
+    remove_client(i, p);
+    return;
+  }
+  if (c->wlen > c->woff && !journal_durable(c->seq))
+    park_client(i, p);
+
+  if (p->backend == POOL_SELECT) {
+    /* Level-triggered: only watch for what the client can make progress on */
+    if (c->wlen - c->woff < MAXPENDING && !eof)
+      FD_SET(p->clientfd[i], &p->read_set);
+    else
+      FD_CLR(p->clientfd[i], &p->read_set);
+    if (c->wlen > c->woff && !c->parked)
+      FD_SET(p->clientfd[i], &p->write_set);
+    else
+      FD_CLR(p->clientfd[i], &p->write_set);
+  }
+}
+
+/* Hold the replies of the client in slot i until its last trade commits */
+void park_client(int i, pool *p) {
+  client_t *c = p->clients[i];
+
+  if (c->parked)
+    return;
+  c->parked = 1;
+  if (p->nparked == p->parkcap) {
+    p->parkcap = max(64, 2 * p->parkcap);
+    p->parked = Realloc(p->parked, p->parkcap * sizeof(int));
+  }
+  p->parked[p->nparked++] = i;
+}
+
+/*
+ * release_clients - Empty the commit pipe and serve again every parked
+ * client whose last trade is now on disk, which sends its replies. An
+ * entry whose client left, or was released and parked anew, is dropped;
+ * those parked while the list is walked are kept behind the survivors.
+ */
+void release_clients(pool *p) {
+  char buf[64];
+  int i, k, n = p->nparked, kept = 0;
+  client_t *c;
+
+  while (read(p->commitfd, buf, sizeof(buf)) > 0)
+    ;
+  for (k = 0; k < n; k++) {
+    i = p->parked[k];
+    if ((c = p->clients[i]) == NULL || !c->parked)
+      continue;
+    if (!journal_durable(c->seq)) {
+      p->parked[kept++] = i;
+      continue;
+    }
+    c->parked = 0;
+#ifdef __linux__
+    if (p->backend == POOL_URING) {
+      uring_serve(i, p);
+      continue;
+    }
+#endif
+    serve_client(i, p);
+  }
+  memmove(p->parked + kept, p->parked + n, (p->nparked - n) * sizeof(int));
+  p->nparked = kept + p->nparked - n;
+}
+
+/*
+ * answer_one - Answer the first complete request buffered for c, once its
+ * first byte has told a binary client from a text one. Returns 0 if no
+ * request is complete yet. Once a successor took over, what is buffered
+ * is dropped unanswered, as the stocks are no longer this server's.
+ */
+int answer_one(client_t *c) {
+  char *line, *nl;
+  bin_req req;
+  int n;
+
+  if (stop_successor() >= 0) {
+    c->rio.rio_bufptr = c->rio.rio_buf;
+    c->rio.rio_cnt = 0;
+    return 0;
+  }
+
+  if (!c->greeted && c->rio.rio_cnt > 0) {
+    c->greeted = 1;
+    if ((unsigned char)*c->rio.rio_bufptr == PROTO_BINARY) {
+      c->binary = 1;
+      c->rio.rio_bufptr++;
+      c->rio.rio_cnt--;
+    }
+  }
+
+  if (c->binary) {
+    if (c->rio.rio_cnt < (int)sizeof(bin_req))
+      return 0;
+    memcpy(&req, c->rio.rio_bufptr, sizeof(bin_req));
+    c->rio.rio_bufptr += sizeof(bin_req);
+    c->rio.rio_cnt -= sizeof(bin_req);
+    handle_binary(c, &req);
+    return 1;
+  }
+  if (c->rio.rio_cnt == 0 ||
+      (nl = memchr(c->rio.rio_bufptr, '\n', c->rio.rio_cnt)) == NULL)
+    return 0;
+  line = c->rio.rio_bufptr;
+  n = nl - line + 1;
+  c->rio.rio_bufptr += n;
+  c->rio.rio_cnt -= n;
+  *nl = '\0';
+  printf("server received %d bytes\n", n);
+  handle_request(c, line);
+  return 1;
+}
+
+#ifdef __linux__
+/*
+ * serve_uring - The loop of an io_uring pool. Every request for the
+ * kernel, accepts, receives and sends, is queued in the ring; one
+ * io_uring_enter submits them all and waits, and the completions are
+ * handled in a batch. A client has a receive in flight, or a send with
+ * the next receive linked behind it, or a send alone while it still has
+ * requests to answer, so its buffers stay put while the kernel has them
+ * and it is closed only once nothing is in flight. A client whose replies
+ * wait for a commit has nothing in flight until the poll of the commit
+ * pipe releases it, and one whose receive found every provided buffer
+ * taken has nothing in flight until a buffer is recycled. A poll of the
+ * stop pipe starts the drain, and a timeout then ticks until the deadline.
+ */
+void serve_uring(pool *p) {
+  struct io_uring_cqe *cqe;
+  unsigned long long data;
+  int res, flags, fd;
+  client_t *c;
+
+  while (!p->stopping || p->nclients > 0) {
+    uring_wait(&p->ring);
+    while ((cqe = uring_peek(&p->ring)) != NULL) {
+      data = cqe->user_data;
+      res = cqe->res;
+      flags = cqe->flags;
+      uring_seen(&p->ring);
+      fd = data >> 3;
+      c = (data & 7) <= URING_LINKED && (data & 7) != URING_ACCEPT
+              ? p->clients[fd]
+              : NULL;
+
+      switch (data & 7) {
+      case URING_ACCEPT:
+        if (res >= 0)
+          add_client(res, p);
+        else if (!p->stopping)
+          fprintf(stderr, "Accept error: %s\n", strerror(-res));
+        if (!(flags & IORING_CQE_F_MORE) && !p->stopping) /* it ended */
+          uring_accept(&p->ring, fd, data);
+        break;
+      case URING_STOP:
+        begin_drain(p);
+        break;
+      case URING_TICK:
+        check_deadline(p);
+        uring_timeout(&p->ring, DRAIN_TICK_MS, data);
+        break;
+      case URING_COMMIT:
+        release_clients(p);
+        uring_poll(&p->ring, fd, data);
+        break;
+      case URING_RECV:
+        if (res == -ENOBUFS) { /* clients hold every buffer: wait for one */
+          uring_starve(fd, p);
+        } else if (res == -EAGAIN || res == -EWOULDBLOCK) { /* no data yet */
+          uring_receive(fd, p);
+        } else if (res <= 0) { /* EOF, error, or its linked send failed */
+          remove_client(fd, p);
+        } else {
+          c->bid = flags >> IORING_CQE_BUFFER_SHIFT;
+          c->in = uring_buf(&p->ring, c->bid);
+          c->inlen = res;
+          uring_serve(fd, p);
         }
-      } else {
-        // write stock data to file
-        fp = Fopen("stock.txt", "w");
-        memset(result, '\0', MAXLINE);
-        for (int i = 0; i < STOCK_NUM; i++) {
-          if (order[i]) {
-            sprintf(status, "%d %d %d\n", order[i]->ID, order[i]->left_stock,
-                    order[i]->price);
-            strcat(result, status);
-          }
+        break;
+      case URING_SEND:
+        if (res != (int)(c->wlen - c->woff)) {
+          remove_client(fd, p);
+          break;
         }
-        Write(fileno(fp), result, strlen(result));
-        // Close the file after writing
-        Fclose(fp);
-        Rio_readlineb(rio, buf, MAXLINE);
-        Fputs(buf, stdout);
-        Close(connfd);
-        FD_CLR(connfd, &p->read_set);
-        p->clientfd[i] = -1;
+        c->wlen = c->woff = 0;
+        uring_serve(fd, p);
+        break;
+      case URING_LINKED:
+        /* the receive behind it completes next, cancelled on failure */
+        if (res == (int)(c->wlen - c->woff))
+          c->wlen = c->woff = 0;
+        break;
+      }
+    }
+  }
+}
+
+/*
+ * uring_serve - Answer what the client on fd has buffered, copying more
+ * of its received bytes into rio as requests are answered, then queue
+ * the replies. While too many replies are pending, the rest waits for the
+ * send to complete; otherwise the next receive is linked behind the send,
+ * so it starts once the replies are out. Replies to trades the journal
+ * has not committed yet park the client instead.
+ */
+void uring_serve(int fd, pool *p) {
+  client_t *c = p->clients[fd];
+  rio_t *rp = &c->rio;
+  int n, more;
+
+  while (!(more = c->wlen - c->woff >= MAXPENDING)) {
+    if (answer_one(c))
+      continue;
+    if (c->inlen == 0)
+      break;
+    /* Make room behind the partial request and take more bytes */
+    if (rp->rio_bufptr != rp->rio_buf) {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == RIO_BUFSIZE) {
+      /* A line longer than the buffer is cut, as Rio_readlineb would */
+      rp->rio_buf[RIO_BUFSIZE - 1] = '\n';
+      continue;
+    }
+    n = min(c->inlen, RIO_BUFSIZE - rp->rio_cnt);
+    memcpy(rp->rio_buf + rp->rio_cnt, c->in, n);
+    rp->rio_cnt += n;
+    c->in += n;
+    c->inlen -= n;
+  }
+  if (c->in != NULL && c->inlen == 0) {
+    c->in = NULL;
+    uring_refill(c->bid, p);
+  }
+
+  if (c->wlen > c->woff && !journal_durable(c->seq)) {
+    park_client(fd, p);
+    return;
+  }
+  if (c->wlen > c->woff)
+    uring_send(&p->ring, fd, c->wbuf + c->woff, c->wlen - c->woff, !more,
+               URING_DATA(fd, more ? URING_SEND : URING_LINKED));
+  if (!more)
+    uring_receive(fd, p);
+}
+
+/* Queue a receive for the client on fd, noting the buffers recycled so far */
+void uring_receive(int fd, pool *p) {
+  p->clients[fd]->recvgen = p->recycled;
+  uring_recv(&p->ring, fd, URING_DATA(fd, URING_RECV));
+}
+
+/*
+ * uring_starve - Hold the receive of the client on fd, which found every
+ * provided buffer taken, until one is recycled; receiving again at once
+ * would only fail again and spin the loop. A buffer recycled since the
+ * receive was queued may have come too late for it, so it receives again
+ * at once; otherwise every buffer is held by a client or fills for one,
+ * and is recycled later.
+ */
+void uring_starve(int fd, pool *p) {
+  client_t *c = p->clients[fd];
+
+  if (c->recvgen != p->recycled) {
+    uring_receive(fd, p);
+    return;
+  }
+  c->starved = 1;
+  if (p->nstarved == p->starvecap && p->starvehead > 0) {
+    memmove(p->starved, p->starved + p->starvehead,
+            (p->nstarved - p->starvehead) * sizeof(int));
+    p->nstarved -= p->starvehead;
+    p->starvehead = 0;
+  }
+  if (p->nstarved == p->starvecap) {
+    p->starvecap = max(64, 2 * p->starvecap);
+    p->starved = Realloc(p->starved, p->starvecap * sizeof(int));
+  }
+  p->starved[p->nstarved++] = fd;
+}
+
+/*
+ * uring_refill - Give provided buffer bid back to the kernel and receive
+ * again for the client that has waited longest for one, if any. An entry
+ * whose client left meanwhile is dropped.
+ */
+void uring_refill(unsigned bid, pool *p) {
+  client_t *c;
+  int fd;
+
+  uring_recycle(&p->ring, bid);
+  p->recycled++;
+  while (p->starvehead < p->nstarved) {
+    fd = p->starved[p->starvehead++];
+    if ((c = p->clients[fd]) != NULL && c->starved) {
+      c->starved = 0;
+      uring_receive(fd, p);
+      break;
+    }
+  }
+  if (p->starvehead == p->nstarved)
+    p->starvehead = p->nstarved = 0;
+}
+#endif
+
+/*
+ * client_send - Queue len bytes of reply for c. Nothing is written here:
+ * serve_client flushes the queue once the requests at hand are answered.
+ */
+void client_send(client_t *c, const char *buf, size_t len) {
+  if (c->wlen + len > c->wcap) {
+    c->wcap = max(c->wlen + len, 2 * c->wcap);
+    c->wbuf = Realloc(c->wbuf, c->wcap);
+  }
+  memcpy(c->wbuf + c->wlen, buf, len);
+  c->wlen += len;
+}
+
+/*
+ * client_reply - Queue the len-byte reply in buf. Legacy clients read
+ * exactly MAXLINE bytes per reply, so it is NUL-padded for them and a
+ * longer show is cut after its last whole line; a framed client gets a
+ * header and the payload of any size, which leave in the same writes.
+ */
+void client_reply(client_t *c, char *buf, size_t len) {
+  static const char zeros[MAXLINE];
+  char hdr[PROTO_FRAMEHDR];
+  char *cut;
+
+  if (!c->framed) {
+    if (len >= MAXLINE) {
+      for (cut = buf + MAXLINE - 1; cut > buf && cut[-1] != '\n'; cut--)
+        ;
+      len = cut - buf;
+    }
+    client_send(c, buf, len);
+    client_send(c, zeros, MAXLINE - len);
+    return;
+  }
+  client_send(c, hdr, sprintf(hdr, "%zu\n", len));
+  client_send(c, buf, len);
+}
+
+/*
+ * client_flush - Write queued replies until done or the socket would
+ * block; -1 on error. Nothing is written while the journal has not
+ * committed the client's last trade.
+ */
+int client_flush(client_t *c) {
+  ssize_t n;
+
+  if (!journal_durable(c->seq))
+    return 0;
+
+  while (c->woff < c->wlen) {
+    /* A client that reset the connection fails the send, not the server */
+    n = send(c->rio.rio_fd, c->wbuf + c->woff, c->wlen - c->woff,
+             MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+      /* Keep the unsent tail at the front so wbuf does not creep */
+      memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+      c->wlen -= c->woff;
+      c->woff = 0;
+      return 0;
+    }
+    c->woff += n;
+  }
+  c->wlen = c->woff = 0;
+  return 0;
+}
+
+/* Parse one request line of client c and queue the reply */
+void handle_request(client_t *c, char *buf) {
+  int id;
+  char status[MAXLINE] = {
+      '\0',
+  };
+  char *comp[4] =
+      {
+          NULL,
+      },
+       *stateptr, *text;
+  size_t len;
+  bin_stock *rec;
+  int n;
+
+  /* Parse the line from the client */
+  comp[0] = strtok_r(buf, " \n", &stateptr);
+  for (int x = 1; x < 4; x++) {
+    comp[x] = strtok_r(NULL, " \n", &stateptr);
+  }
+  if (comp[0] == NULL)
+    return;
+
+  /* Do the appropriate action based on the parsed line */
+  if (!strcmp(comp[0], "show") && comp[1] != NULL) {
+    /* show lo hi: the stocks with IDs in lo..hi, in ID order */
+    id = atoi(comp[1]);
+    rec = query_stocks(OP_RANGE, id, comp[2] ? atoi(comp[2]) : id, &n);
+    text = render_stocks(rec, n, &len);
+    client_reply(c, text, len);
+  } else if (!strcmp(comp[0], "show")) {
+    /* show the latest rendering of the stock table */
+    text = show_text(&len);
+    client_reply(c, text, len);
+  } else if (!strcmp(comp[0], "top") && comp[1] != NULL && comp[2] != NULL &&
+             (!strcmp(comp[2], "price") || !strcmp(comp[2], "stock"))) {
+    /* top n price|stock: the n best stocks by that key */
+    rec = query_stocks(OP_TOP, atoi(comp[1]),
+                       strcmp(comp[2], "price") ? TOP_STOCK : TOP_PRICE, &n);
+    text = render_stocks(rec, n, &len);
+    client_reply(c, text, len);
+  } else if (!strcmp(comp[0], "top")) {
+    sprintf(status, "[top] fail\n");
+    client_reply(c, status, strlen(status));
+  } else if (!strcmp(comp[0], "buy")) {
+    /* buy id n: take n shares of a stock */
+    if (comp[2] == NULL) {
+      sprintf(status, "[buy] fail\n");
+    } else if (!buy_stock(atoi(comp[1]), atoi(comp[2]), &c->seq)) {
+      sprintf(status, "Not enough left stocks\n");
+    } else {
+      sprintf(status, "[buy] success\n");
+    }
+    client_reply(c, status, strlen(status));
+  } else if (!strcmp(comp[0], "sell")) {
+    /* sell id n: give n shares of a stock back */
+    if (comp[2] == NULL || !sell_stock(atoi(comp[1]), atoi(comp[2]), &c->seq)) {
+      sprintf(status, "[sell] fail\n");
+    } else {
+      sprintf(status, "[sell] success\n");
+    }
+    client_reply(c, status, strlen(status));
+  } else if (!strcmp(comp[0], "list")) {
+    /* list id left price: add a stock to the market */
+    if (comp[3] == NULL ||
+        !list_stock(atoi(comp[1]), atoi(comp[2]), atoi(comp[3]))) {
+      sprintf(status, "[list] fail\n");
+    } else {
+      sprintf(status, "[list] success\n");
+    }
+    client_reply(c, status, strlen(status));
+  } else if (!strcmp(comp[0], "delist")) {
+    /* delist id: take a stock off the market */
+    if (comp[1] == NULL || !delist_stock(atoi(comp[1]))) {
+      sprintf(status, "[delist] fail\n");
+    } else {
+      sprintf(status, "[delist] success\n");
+    }
+    client_reply(c, status, strlen(status));
+  } else if (!strcmp(comp[0], "exit")) {
+    sprintf(status, "exit\n");
+    client_reply(c, status, strlen(status));
+  } else if (!strcmp(comp[0], PROTO_FRAMED)) {
+    c->framed = 1;
+    sprintf(status, "ok\n");
+    client_reply(c, status, strlen(status));
+  }
+}
+
+/* Answer one request of a binary-protocol client (see stockproto.h) */
+void handle_binary(client_t *c, bin_req *req) {
+  bin_reply reply;
+  bin_stock *rec = NULL;
+  int n = 0, done;
+
+  memset(&reply, 0, sizeof(bin_reply));
+  reply.op = req->op;
+  switch (req->op) {
+  case OP_SHOW:
+    rec = show_binary(&n);
+    done = 1;
+    break;
+  case OP_RANGE:
+  case OP_TOP:
+    done = req->op == OP_RANGE || ntohl(req->qty) <= TOP_STOCK;
+    if (done) {
+      rec = query_stocks(req->op, ntohl(req->id), ntohl(req->qty), &n);
+      for (int i = 0; i < n; i++) {
+        rec[i].id = htonl(rec[i].id);
+        rec[i].left = htonl(rec[i].left);
+        rec[i].price = htonl(rec[i].price);
       }
     }
+    break;
+  case OP_BUY:
+    done = buy_stock(ntohl(req->id), ntohl(req->qty), &c->seq);
+    break;
+  case OP_SELL:
+    done = sell_stock(ntohl(req->id), ntohl(req->qty), &c->seq);
+    break;
+  case OP_EXIT:
+    done = 1;
+    break;
+  default:
+    done = 0;
+    break;
+  }
+  reply.status = done ? BIN_OK : BIN_FAIL;
+  reply.count = htonl(n);
+  client_send(c, (char *)&reply, sizeof(bin_reply));
+  client_send(c, (char *)rec, n * sizeof(bin_stock));
+}
+
+/*
+ * read_stock - Return the left stock of s, read under the readers protocol
+ * since other reactors may be trading it.
+ */
+int read_stock(item *s) {
+  int left;
+
+  P(&mutex);            /* get the lock for reading */
+  s->read_cnt++;        /* increase the read count */
+  if (s->read_cnt == 1) /* after it is properly increased */
+    P(&s->mutex);       /* get the lock for item */
+  V(&mutex);            /* free the lock for reading*/
+  left = s->left_stock;
+  P(&mutex);            /* get the lock for reading */
+  s->read_cnt--;        /* decrease the read count */
+  if (s->read_cnt == 0) /* after it is properly decreased */
+    V(&s->mutex);       /* free the lock for item */
+  V(&mutex);            /* free the lock for reading */
+  return left;
+}
+
+/* Size the show rendering for every stock loaded from stock.txt */
+void init_snapshot(void) {
+  snap.cap = max(universe->count, 1);
+  snap.text = Malloc(snap.cap * SHOW_LINE);
+  snap.recs = Malloc(snap.cap * sizeof(bin_stock));
+}
+
+/*
+ * refresh_snapshot - Re-render snap if a trade happened since it was taken.
+ * Called with snap_mutex held. The version is read before the table, so a
+ * trade racing with the rendering only makes the next show render again.
+ * A list bumps the version too, and grows snap if it has to.
+ */
+static void refresh_snapshot(void) {
+  unsigned long version = __atomic_load_n(&table_version, __ATOMIC_ACQUIRE);
+  universe_t *u;
+  item **order;
+  int left;
+
+  if (snap.version == version)
+    return;
+  rcu_read_lock();
+  u = __atomic_load_n(&universe, __ATOMIC_ACQUIRE);
+  order = u->order;
+  if (u->count > snap.cap) {
+    snap.cap = u->count;
+    snap.text = Realloc(snap.text, snap.cap * SHOW_LINE);
+    snap.recs = Realloc(snap.recs, snap.cap * sizeof(bin_stock));
+  }
+  snap.len = 0;
+  snap.count = 0;
+  for (int i = 0; i < u->count; i++) {
+    left = read_stock(order[i]);
+    snap.len += sprintf(snap.text + snap.len, "%d %d %d\n", order[i]->ID,
+                        left, order[i]->price);
+    snap.recs[snap.count].id = htonl(order[i]->ID);
+    snap.recs[snap.count].left = htonl(left);
+    snap.recs[snap.count].price = htonl(order[i]->price);
+    snap.count++;
+  }
+  rcu_read_unlock();
+  snap.version = version;
+}
+
+/*
+ * show_text - Copy the text show reply into a buffer of the calling
+ * reactor, which keeps it until its next show, and set *len to its length.
+ */
+char *show_text(size_t *len) {
+  static __thread char *buf; /* Grown to the largest rendering copied */
+  static __thread size_t cap;
+
+  P(&snap_mutex);
+  refresh_snapshot();
+  if (snap.len > cap || buf == NULL) {
+    cap = snap.len;
+    buf = Realloc(buf, max(cap, 1));
+  }
+  memcpy(buf, snap.text, snap.len);
+  *len = snap.len;
+  V(&snap_mutex);
+  return buf;
+}
+
+/* Copy the binary show records as show_text does; *count gets how many */
+bin_stock *show_binary(int *count) {
+  static __thread bin_stock *rec; /* Grown to the most records copied */
+  static __thread int cap;
+
+  P(&snap_mutex);
+  refresh_snapshot();
+  if (snap.count > cap || rec == NULL) {
+    cap = snap.count;
+    rec = Realloc(rec, max(cap, 1) * sizeof(bin_stock));
+  }
+  memcpy(rec, snap.recs, snap.count * sizeof(bin_stock));
+  *count = snap.count;
+  V(&snap_mutex);
+  return rec;
+}
+
+/* Order by_price entries by price, highest first, then by ID */
+static int cmp_price(const void *a, const void *b) {
+  item *x = *(item **)a, *y = *(item **)b;
+
+  if (x->price != y->price)
+    return x->price > y->price ? -1 : 1;
+  return (x->ID > y->ID) - (x->ID < y->ID);
+}
+
+/* Restore the min-heap on left below slot i of the n records of heap */
+static void sift_down(bin_stock *heap, int n, int i) {
+  bin_stock tmp;
+  int c;
+
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n && (int)heap[c + 1].left < (int)heap[c].left)
+      c++;
+    if ((int)heap[i].left <= (int)heap[c].left)
+      break;
+    tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+}
+
+/*
+ * top_stock - Collect the n stocks with the most left, most first, into
+ * rec. Counts change with every trade, so the table is scanned keeping the
+ * best n seen in a min-heap, which is then sorted in place.
+ */
+static int top_stock(universe_t *u, int n, bin_stock *rec) {
+  item **by_price = u->by_price;
+  int k = 0, total = u->count, left;
+  bin_stock tmp;
+
+  for (int i = 0; i < total && n > 0; i++) {
+    left = read_stock(by_price[i]);
+    if (k == n && left <= (int)rec[0].left)
+      continue;
+    if (k < n) {
+      /* grow the heap and let the new record climb to its place */
+      int j = k++;
+      while (j > 0 && (int)rec[(j - 1) / 2].left > left) {
+        rec[j] = rec[(j - 1) / 2];
+        j = (j - 1) / 2;
+      }
+      rec[j].id = by_price[i]->ID;
+      rec[j].left = left;
+      rec[j].price = by_price[i]->price;
+    } else {
+      rec[0].id = by_price[i]->ID;
+      rec[0].left = left;
+      rec[0].price = by_price[i]->price;
+      sift_down(rec, k, 0);
+    }
+  }
+  for (int i = k - 1; i > 0; i--) {
+    tmp = rec[0];
+    rec[0] = rec[i];
+    rec[i] = tmp;
+    sift_down(rec, i, 0);
+  }
+  return k;
+}
+
+/*
+ * query_stocks - Collect the stocks a request asks for into this thread's
+ * buffer, in host byte order, and set *count. OP_RANGE takes the stocks
+ * with IDs a..b in ID order; the subtree sizes count them beforehand, so
+ * the buffer is sized in O(log n). OP_TOP takes the a best stocks by key
+ * b: prices never change, so by_price already holds that ranking.
+ */
+bin_stock *query_stocks(int op, int a, int b, int *count) {
+  static __thread bin_stock *rec;
+  static __thread int cap;
+  universe_t *u;
+  int n;
+
+  rcu_read_lock();
+  u = __atomic_load_n(&universe, __ATOMIC_ACQUIRE);
+  if (op == OP_RANGE)
+    n = a > b ? 0
+              : count_below(u->tree, (long)b + 1) - count_below(u->tree, a);
+  else
+    n = max(0, min(a, u->count));
+  if (n > cap) {
+    cap = n;
+    rec = Realloc(rec, cap * sizeof(bin_stock));
+  }
+  if (op == OP_RANGE) {
+    *count = range_stocks(u->tree, a, b, rec);
+  } else if (b == TOP_PRICE) {
+    for (int i = 0; i < n; i++) {
+      rec[i].id = u->by_price[i]->ID;
+      rec[i].left = read_stock(u->by_price[i]);
+      rec[i].price = u->by_price[i]->price;
+    }
+    *count = n;
+  } else {
+    *count = top_stock(u, n, rec);
+  }
+  rcu_read_unlock();
+  return rec;
+}
+
+/* Render n host-order records as show lines in this thread's buffer */
+char *render_stocks(bin_stock *rec, int n, size_t *len) {
+  static __thread char *buf;
+  static __thread int cap;
+
+  if (n > cap || buf == NULL) {
+    cap = n;
+    buf = Realloc(buf, max(cap, 1) * SHOW_LINE);
+  }
+  *len = 0;
+  for (int i = 0; i < n; i++)
+    *len += sprintf(buf + *len, "%d %d %d\n", (int)rec[i].id, (int)rec[i].left,
+                    (int)rec[i].price);
+  return buf;
+}
+
+/*
+ * make_universe - Wrap tree and order, the count stocks of a version, in a
+ * universe with its price ranking and ID index. Admin changes are rare,
+ * so both are simply rebuilt for each one.
+ */
+universe_t *make_universe(node *tree, item **order, int count) {
+  universe_t *u = Malloc(sizeof(universe_t));
+  int lo = 0, hi = 0;
+
+  u->tree = tree;
+  u->count = count;
+  u->order = order;
+  u->by_price = Malloc(max(count, 1) * sizeof(item *));
+  memcpy(u->by_price, order, count * sizeof(item *));
+  qsort(u->by_price, count, sizeof(item *), cmp_price);
+  for (int i = 0; i < count; i++) {
+    if (i == 0 || order[i]->ID < lo)
+      lo = order[i]->ID;
+    if (i == 0 || order[i]->ID > hi)
+      hi = order[i]->ID;
+  }
+  index_init(&u->index, index_choice, count, lo, hi);
+  for (int i = 0; i < count; i++)
+    index_insert(&u->index, order[i]->ID, order[i]);
+  return u;
+}
+
+/*
+ * publish - Make next the universe reactors see, free the old one once no
+ * reactor holds it, and checkpoint, so the change survives a restart
+ * without the journal having to record it. Called with admin_mutex held;
+ * the reactor running it waits, the others keep serving.
+ */
+void publish(universe_t *next) {
+  universe_t *old = universe;
+
+  __atomic_store_n(&universe, next, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&table_version, 1, __ATOMIC_RELEASE);
+  rcu_retire(old->order);
+  rcu_retire(old->by_price);
+  index_free(&old->index, rcu_retire);
+  rcu_retire(old);
+  rcu_synchronize();
+  save_stocks();
+}
+
+/* List stock id with left shares at price; returns 0 if it is listed */
+int list_stock(int id, int left, int price) {
+  universe_t *u;
+  item **order;
+  node *tree;
+  long lo = id, hi = id;
+
+  P(&admin_mutex);
+  u = universe;
+  for (int i = 0; i < u->count; i++) {
+    lo = min(lo, u->order[i]->ID);
+    hi = max(hi, u->order[i]->ID);
+  }
+  if (left < 0 || query_stock(u->tree, id) != NULL ||
+      (index_choice == INDEX_DIRECT && hi - lo >= INDEX_DIRECT_MAX)) {
+    V(&admin_mutex);
+    return 0;
+  }
+  tree_gen++;
+  tree = insert_stock(u->tree, id, left, price);
+  order = Malloc((u->count + 1) * sizeof(item *));
+  memcpy(order, u->order, u->count * sizeof(item *));
+  order[u->count] = query_stock(tree, id);
+  publish(make_universe(tree, order, u->count + 1));
+  V(&admin_mutex);
+  return 1;
+}
+
+/* Take stock id off the market; returns 0 if it is not listed */
+int delist_stock(int id) {
+  universe_t *u;
+  item **order, *s;
+  node *tree;
+  int n = 0;
+
+  P(&admin_mutex);
+  u = universe;
+  if ((s = query_stock(u->tree, id)) == NULL) {
+    V(&admin_mutex);
+    return 0;
+  }
+  tree_gen++;
+  tree = delete_stock(u->tree, id);
+  order = Malloc(max(u->count - 1, 1) * sizeof(item *));
+  for (int i = 0; i < u->count; i++)
+    if (u->order[i] != s)
+      order[n++] = u->order[i];
+  publish(make_universe(tree, order, n));
+  // No trade can hold the item once publish is done
+  sem_destroy(&s->mutex);
+  Free(s);
+  V(&admin_mutex);
+  return 1;
+}
+
+/*
+ * buy_stock - Buy stock shares of id; returns 0 if it is unknown or not
+ * enough are left. The trade is journaled inside the read section, so a
+ * delist's checkpoint comes after it, and *seq gets its record, which the
+ * reply waits for.
+ */
+int buy_stock(int id, int stock, unsigned long *seq) {
+  item *stock_item;
+  int ok = 0;
+
+  rcu_read_lock();
+  if ((stock_item = find_stock(id)) != NULL) {
+    P(&stock_item->mutex);
+    if ((ok = stock_item->left_stock >= stock)) {
+      stock_item->left_stock -= stock;
+      *seq = journal_append(id, stock_item->left_stock, 0);
+    }
+    V(&stock_item->mutex);
   }
+  rcu_read_unlock();
+  if (ok)
+    __atomic_add_fetch(&table_version, 1, __ATOMIC_RELEASE);
+  return ok;
+}
+
+/* Sell stock shares of id; returns 0 if it is unknown */
+int sell_stock(int id, int stock, unsigned long *seq) {
+  item *stock_item;
+
+  rcu_read_lock();
+  if ((stock_item = find_stock(id)) == NULL) {
+    rcu_read_unlock();
+    return 0;
+  }
+  P(&stock_item->mutex);
+  stock_item->left_stock += stock;
+  *seq = journal_append(id, stock_item->left_stock, 0);
+  V(&stock_item->mutex);
+  rcu_read_unlock();
+  __atomic_add_fetch(&table_version, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * save_stocks - Checkpoint the stock table to stock.txt. The journal is
+ * rotated before the table is copied, so a trade is in the copy, in the
+ * new journal or in both; its record holds the new count, so replaying it
+ * over the copy is harmless. Locking every item for the copy would stall
+ * trading on a large table. The file is written to a temporary that
+ * replaces stock.txt only once it is complete and on disk. The flusher
+ * and list/delist both checkpoint, one at a time.
+ */
+void save_stocks(void) {
+  bin_stock *rec;
+  int n;
+  FILE *fp;
+
+  P(&save_mutex);
+  if (universe == NULL) { /* freed by free_stocks */
+    V(&save_mutex);
+    return;
+  }
+  journal_rotate();
+  rec = copy_stocks(&n);
+
+  fp = Fopen("stock.txt.tmp", "w");
+  for (int i = 0; i < n; i++)
+    fprintf(fp, "%d %d %d\n", (int)rec[i].id, (int)rec[i].left,
+            (int)rec[i].price);
+  Free(rec);
+  if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+    unix_error("fsync error");
+  // Close the file after writing
+  Fclose(fp);
+  if (rename("stock.txt.tmp", "stock.txt") < 0)
+    unix_error("rename error");
+  journal_retire();
+  V(&save_mutex);
+}
+
+/*
+ * cutover - Stop trading for good and return the stocks for a successor,
+ * with their count; they have no trade counts. Every reactor stops
+ * answering once the server stops for a successor and then reports in
+ * from begin_drain, so no trade is under way once all of them did.
+ * Checkpoints end here, as stock.txt and the journal are the successor's
+ * from now on, and the journal is committed, so the replies held for it
+ * go out.
+ */
+bin_stock *cutover(int *count, unsigned **version) {
+  for (int i = 0; i < nreactors; i++)
+    P(&reactors_cut);
+  P(&save_mutex); /* never given back */
+  journal_flush();
+  *version = NULL;
+  return copy_stocks(count);
+}
+
+/* Copy the published stocks in the order they were listed, with their count */
+bin_stock *copy_stocks(int *count) {
+  universe_t *u;
+  bin_stock *rec;
+
+  rcu_read_lock();
+  u = __atomic_load_n(&universe, __ATOMIC_ACQUIRE);
+  *count = u->count;
+  rec = Malloc(max(u->count, 1) * sizeof(bin_stock));
+  for (int i = 0; i < u->count; i++) {
+    rec[i].id = u->order[i]->ID;
+    rec[i].left = read_stock(u->order[i]);
+    rec[i].price = u->order[i]->price;
+  }
+  rcu_read_unlock();
+  return rec;
+}
+
+/* Parse the "id left price" lines of stock.txt into records, with their count */
+bin_stock *read_stocks(int *count) {
+  char status[MAXLINE], *stateptr;
+  bin_stock *rec;
+  int n = 0;
+  FILE *fp;
+
+  fp = Fopen("stock.txt", "r");
+  // Size the records by the lines of the file, one stock each
+  while (Fgets(status, MAXLINE, fp) != NULL)
+    n++;
+  rewind(fp);
+  rec = Malloc(max(n, 1) * sizeof(bin_stock));
+  *count = 0;
+  while (*count < n && Fgets(status, MAXLINE, fp) != NULL) {
+    rec[*count].id = atoi(strtok_r(status, " ", &stateptr));
+    rec[*count].left = atoi(strtok_r(NULL, " ", &stateptr));
+    rec[*count].price = atoi(strtok_r(NULL, " ", &stateptr));
+    (*count)++;
+  }
+  Fclose(fp);
+  return rec;
+}
+
+/*
+ * free_stocks - Free the universe, its tree and its stocks once every
+ * reactor is done. A checkpoint the flusher still has due finds no
+ * universe and writes nothing.
+ */
+void free_stocks(void) {
+  universe_t *u;
+
+  P(&save_mutex);
+  u = universe;
+  __atomic_store_n(&universe, NULL, __ATOMIC_RELEASE);
+  V(&save_mutex);
+  rcu_synchronize();
+  free_tree(u->tree);
+  for (int i = 0; i < u->count; i++) {
+    sem_destroy(&u->order[i]->mutex);
+    Free(u->order[i]);
+  }
+  Free(u->order);
+  Free(u->by_price);
+  index_free(&u->index, Free);
+  Free(u);
+}
+
+/*
+ * Set the left stock of id as a journal record says; they come in order.
+ * Replay runs before any reactor, so no read section is needed.
+ */
+void apply_record(int id, int left, unsigned version) {
+  item *stock_item = find_stock(id);
+
+  if (stock_item != NULL)
+    stock_item->left_stock = left;
 }
 
 /* Rotate the tree to the left */
 node *left_rotate(node *x) {
-  node *y = x->right;
+  x = fresh(x);
+  node *y = x->right = fresh(x->right);
   node *T2 = y->left;
 
   y->left = x;
   x->right = T2;
 
-  x->height = max(height(x->left), height(x->right)) + 1;
-  y->height = max(height(y->left), height(y->right)) + 1;
+  update_node(x);
+  update_node(y);
 
   return y;
 }
 
 /* Rotate the tree to the right */
 node *right_rotate(node *y) {
-  node *x = y->left;
+  y = fresh(y);
+  node *x = y->left = fresh(y->left);
   node *T2 = x->right;
 
   x->right = y;
   y->left = T2;
 
-  y->height = max(height(y->left), height(y->right)) + 1;
-  x->height = max(height(x->left), height(x->right)) + 1;
+  update_node(y);
+  update_node(x);
 
   return x;
 }
@@ -289,7 +1837,20 @@ int get_balance(node *n) {
 /* Get the height of the tree */
 int height(node *n) { return n == NULL ? 0 : n->height; }
 
-/* Insert the node into the tree */
+/* Get the number of stocks in the tree */
+int tree_size(node *n) { return n == NULL ? 0 : n->size; }
+
+/* Recompute the height and the size of n from its children */
+void update_node(node *n) {
+  n->height = max(height(n->left), height(n->right)) + 1;
+  n->size = tree_size(n->left) + tree_size(n->right) + 1;
+}
+
+/*
+ * insert_stock - Insert the stock into the tree and return its new root.
+ * Nodes made before this update are copied before they change, so
+ * readers of the old root keep an intact tree.
+ */
 node *insert_stock(node *tree, int id, int left_stock, int price) {
   if (tree == NULL) {
     item *z = malloc(sizeof(item));
@@ -303,14 +1864,12 @@ node *insert_stock(node *tree, int id, int left_stock, int price) {
     new_node->stock = z;
     new_node->left = new_node->right = NULL;
     new_node->height = 1;
+    new_node->size = 1;
+    new_node->gen = tree_gen;
     return new_node;
   }
 
-  if (id < tree->stock->ID)
-    tree->left = insert_stock(tree->left, id, left_stock, price);
-  else if (id > tree->stock->ID)
-    tree->right = insert_stock(tree->right, id, left_stock, price);
-  else {
+  if (id == tree->stock->ID) {
     P(&tree->stock->mutex);
     tree->stock->left_stock = left_stock;
     tree->stock->price = price;
@@ -318,80 +1877,100 @@ node *insert_stock(node *tree, int id, int left_stock, int price) {
     return tree;
   }
 
-  tree->height = 1 + max(height(tree->left), height(tree->right));
-
-  int balance = get_balance(tree);
+  tree = fresh(tree);
+  if (id < tree->stock->ID)
+    tree->left = insert_stock(tree->left, id, left_stock, price);
+  else
+    tree->right = insert_stock(tree->right, id, left_stock, price);
 
-  if (balance > 1 && id < tree->left->stock->ID)
-    return right_rotate(tree);
+  return rebalance(tree);
+}
 
-  if (balance < -1 && id > tree->right->stock->ID)
-    return left_rotate(tree);
+/*
+ * delete_stock - Delete the stock from the tree and return its new root.
+ * A node with two children takes the stock of its successor, whose node
+ * is deleted instead. Copies nodes as insert_stock does; the stock itself
+ * is left to the caller.
+ */
+node *delete_stock(node *tree, int id) {
+  node *child, *succ;
 
-  if (balance > 1 && id > tree->left->stock->ID) {
-    tree->left = left_rotate(tree->left);
-    return right_rotate(tree);
-  }
+  if (tree == NULL)
+    return NULL; // Not found
 
-  if (balance < -1 && id < tree->right->stock->ID) {
-    tree->right = right_rotate(tree->right);
-    return left_rotate(tree);
+  if (id < tree->stock->ID) {
+    tree = fresh(tree);
+    tree->left = delete_stock(tree->left, id);
+  } else if (id > tree->stock->ID) {
+    tree = fresh(tree);
+    tree->right = delete_stock(tree->right, id);
+  } else if (tree->left == NULL || tree->right == NULL) {
+    // One or zero children: the child takes the place of the node
+    child = (tree->left != NULL) ? tree->left : tree->right;
+    discard(tree);
+    return child;
+  } else {
+    // Two children: move the successor's stock up
+    for (succ = tree->right; succ->left != NULL; succ = succ->left)
+      ;
+    tree = fresh(tree);
+    tree->stock = succ->stock;
+    tree->right = delete_stock(tree->right, succ->stock->ID);
   }
 
-  return tree;
+  return rebalance(tree);
 }
 
-/* Delete the node from the tree */
-void delete_stock(node *tree, int id) {
-  node *current = tree->left;
-  node *parent = NULL;
+/* Return n, or a copy of it if readers may hold n; the copy retires n */
+static node *fresh(node *n) {
+  node *copy;
 
-  // Find node to delete
-  while (current != NULL && current->stock->ID != id) {
-    parent = current;
-    if (id < current->stock->ID)
-      current = current->left;
-    else
-      current = current->right;
-  }
-
-  if (current == NULL)
-    return; // Not found
+  if (n->gen == tree_gen)
+    return n;
+  copy = Malloc(sizeof(node));
+  *copy = *n;
+  copy->gen = tree_gen;
+  rcu_retire(n);
+  return copy;
+}
 
-  node *target = current;
+/* Free n, which the update took out of the tree, once readers are done */
+static void discard(node *n) {
+  if (n->gen == tree_gen)
+    Free(n);
+  else
+    rcu_retire(n);
+}
 
-  // Case: two children
-  if (target->left != NULL && target->right != NULL) {
-    P(&target->stock->mutex);
-    node *succ = target->right;
-    while (succ->left != NULL)
-      succ = succ->left;
+/* Free every node of tree n, which no reader can reach any more */
+static void free_tree(node *n) {
+  if (n == NULL)
+    return;
+  free_tree(n->left);
+  free_tree(n->right);
+  Free(n);
+}
 
-    // Copy successor data into target
-    target->stock = succ->stock;
+/* Update n, which the update may change, and rotate it back into balance */
+static node *rebalance(node *n) {
+  int balance;
 
-    // Remove successor node
-    node *to_delete = succ;
-    succ = to_delete->right;
-    V(&target->stock->mutex);
-    sem_destroy(&to_delete->stock->mutex);
-    free(to_delete);
-  } else {
-    P(&target->stock->mutex);
-    // One or zero children
-    node *child = (target->left != NULL) ? target->left : target->right;
+  update_node(n);
+  balance = get_balance(n);
 
-    if (parent == NULL) {
-      // Handle case where root node is deleted
-      tree->left = child;
-    } else {
-      current = child;
-    }
-    V(&target->stock->mutex);
+  if (balance > 1) {
+    if (get_balance(n->left) < 0)
+      n->left = left_rotate(n->left);
+    return right_rotate(n);
+  }
 
-    sem_destroy(&target->stock->mutex);
-    free(target);
+  if (balance < -1) {
+    if (get_balance(n->right) > 0)
+      n->right = right_rotate(n->right);
+    return left_rotate(n);
   }
+
+  return n;
 }
 
 /* Find a specific node from the tree */
@@ -409,4 +1988,50 @@ item *query_stock(node *tree, int id) {
       current = current->right;
   }
   return NULL;
-}
\ No newline at end of file
+}
+
+/*
+ * Find a stock of the published universe through its ID index, or its
+ * tree if it has none. Callers stay in a read section while they use it.
+ */
+item *find_stock(int id) {
+  universe_t *u = __atomic_load_n(&universe, __ATOMIC_ACQUIRE);
+
+  if (u->index.kind == INDEX_TREE)
+    return query_stock(u->tree, id);
+  return index_find(&u->index, id);
+}
+
+/* Count the stocks of the tree with IDs below id, in O(log n) */
+int count_below(node *tree, long id) {
+  int n = 0;
+
+  while (tree != NULL) {
+    if (tree->stock->ID < id) {
+      n += tree_size(tree->left) + 1;
+      tree = tree->right;
+    } else {
+      tree = tree->left;
+    }
+  }
+  return n;
+}
+
+/* Collect the stocks of the tree with IDs in lo..hi into rec, in order */
+int range_stocks(node *tree, int lo, int hi, bin_stock *rec) {
+  int n = 0;
+
+  if (tree == NULL)
+    return 0;
+  if (lo < tree->stock->ID)
+    n += range_stocks(tree->left, lo, hi, rec);
+  if (lo <= tree->stock->ID && tree->stock->ID <= hi) {
+    rec[n].id = tree->stock->ID;
+    rec[n].left = read_stock(tree->stock);
+    rec[n].price = tree->stock->price;
+    n++;
+  }
+  if (tree->stock->ID < hi)
+    n += range_stocks(tree->right, lo, hi, rec + n);
+  return n;
+}
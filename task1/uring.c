@@ -0,0 +1,223 @@
+/*
+ * uring.c - A minimal io_uring(7) ring for the stock server (see uring.h)
+ *
+ * The submission array maps entry i to slot i once and for all, so a
+ * request is queued by filling the next slot and publishing the tail.
+ * Only the calling thread touches its ring: the tails it publishes are
+ * stored with release, and the ones the kernel posts are loaded with
+ * acquire.
+ */
+#include <poll.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "uring.h"
+
+#define URING_CQ_RATIO 4 /* Completion entries per submission entry */
+
+static struct io_uring_sqe *next_sqe(uring_t *r); /* Claims a request slot */
+static int enter(uring_t *r, unsigned wait);     /* Submits, maybe waits */
+
+/* Set up r with at least entries submission entries */
+void uring_init(uring_t *r, unsigned entries) {
+  struct io_uring_params p;
+  size_t sq_len, cq_len;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(uring_t));
+  p.flags = IORING_SETUP_CQSIZE; /* room for a completion per request */
+  p.cq_entries = URING_CQ_RATIO * entries;
+  if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    unix_error("io_uring_setup error");
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) /* both rings in one mapping */
+    sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+  sq = Mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+  cq = (p.features & IORING_FEAT_SINGLE_MMAP)
+           ? sq
+           : Mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = Mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sqe_tail = *r->sq_tail;
+  for (unsigned i = 0; i < p.sq_entries; i++)
+    ((unsigned *)(sq + p.sq_off.array))[i] = i;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+/*
+ * uring_provide - Register nbufs buffers of size bytes, nbufs a power of
+ * two, as the buffer ring of URING_GROUP, and hand all of them over.
+ */
+void uring_provide(uring_t *r, unsigned nbufs, unsigned size) {
+  struct io_uring_buf_reg reg;
+
+  r->br = Mmap(NULL, nbufs * sizeof(struct io_uring_buf),
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  r->bufs = Malloc((size_t)nbufs * size);
+  r->nbufs = nbufs;
+  r->buf_size = size;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)r->br;
+  reg.ring_entries = nbufs;
+  reg.bgid = URING_GROUP;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0)
+    unix_error("io_uring_register error");
+  for (unsigned bid = 0; bid < nbufs; bid++)
+    uring_recycle(r, bid);
+}
+
+/* Return the memory of provided buffer bid */
+char *uring_buf(uring_t *r, unsigned bid) {
+  return r->bufs + (size_t)bid * r->buf_size;
+}
+
+/* Hand provided buffer bid back to the kernel */
+void uring_recycle(uring_t *r, unsigned bid) {
+  struct io_uring_buf *b = &r->br->bufs[r->br_tail & (r->nbufs - 1)];
+
+  /* the ring's tail overlays the reserved field of the first entry */
+  b->addr = (unsigned long)uring_buf(r, bid);
+  b->len = r->buf_size;
+  b->bid = bid;
+  __atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Queue a multishot accept on listenfd; it posts one completion per client */
+void uring_accept(uring_t *r, int listenfd, unsigned long long data) {
+  struct io_uring_sqe *sqe = next_sqe(r);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = data;
+}
+
+/* Queue a receive on fd into whichever provided buffer is free */
+void uring_recv(uring_t *r, int fd, unsigned long long data) {
+  struct io_uring_sqe *sqe = next_sqe(r);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_GROUP;
+  sqe->user_data = data;
+}
+
+/*
+ * uring_send - Queue a send of all len bytes of buf; the kernel retries a
+ * short send itself. With link the next request queued only starts once
+ * this one has completed in full, and is cancelled if it fails.
+ */
+void uring_send(uring_t *r, int fd, void *buf, size_t len, int link,
+                unsigned long long data) {
+  struct io_uring_sqe *sqe = next_sqe(r);
+
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = len;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->flags = link ? IOSQE_IO_LINK : 0;
+  sqe->user_data = data;
+}
+
+/* Queue a one-shot wait for fd to become readable */
+void uring_poll(uring_t *r, int fd, unsigned long long data) {
+  struct io_uring_sqe *sqe = next_sqe(r);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = data;
+}
+
+/*
+ * uring_timeout - Queue a timeout that completes with -ETIME after ms
+ * milliseconds. The kernel reads the interval when the request is
+ * submitted, so r keeps it, and one timeout may be queued per submission.
+ */
+void uring_timeout(uring_t *r, long ms, unsigned long long data) {
+  struct io_uring_sqe *sqe = next_sqe(r);
+
+  r->ts.tv_sec = ms / 1000;
+  r->ts.tv_nsec = ms % 1000 * 1000000;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (unsigned long)&r->ts;
+  sqe->len = 1;
+  sqe->user_data = data;
+}
+
+/* Queue the cancellation of the request queued with target */
+void uring_cancel(uring_t *r, unsigned long long target,
+                  unsigned long long data) {
+  struct io_uring_sqe *sqe = next_sqe(r);
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = target;
+  sqe->user_data = data;
+}
+
+/* Submit what is queued and wait until a completion is posted */
+void uring_wait(uring_t *r) {
+  enter(r, uring_peek(r) == NULL);
+}
+
+/* Return the first completion not seen, or NULL if there is none */
+struct io_uring_cqe *uring_peek(uring_t *r) {
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & r->cq_mask];
+}
+
+/* Mark the completion uring_peek returned as seen */
+void uring_seen(uring_t *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Claim the next submission slot, submitting the queue first if it is full */
+static struct io_uring_sqe *next_sqe(uring_t *r) {
+  struct io_uring_sqe *sqe;
+
+  while (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+         r->sq_entries)
+    enter(r, 0);
+  sqe = &r->sqes[r->sqe_tail++ & r->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+/*
+ * enter - Publish the queued requests and submit them, waiting for wait
+ * completions. A full completion ring (EBUSY) is not an error: the caller
+ * reaps completions and the requests go with the next call.
+ */
+static int enter(uring_t *r, unsigned wait) {
+  unsigned n;
+  int rc;
+
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+  n = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  while ((rc = syscall(__NR_io_uring_enter, r->fd, n, wait,
+                       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0) {
+    if (errno == EBUSY || errno == EAGAIN)
+      return 0;
+    if (errno != EINTR)
+      unix_error("io_uring_enter error");
+  }
+  return rc;
+}
@@ -0,0 +1,79 @@
+/*
+ * uring.h - A minimal io_uring(7) ring for the stock server
+ *
+ * The ring is set up and driven with the raw system calls, so the server
+ * needs no liburing. Requests are queued in the submission ring and all
+ * of them go to the kernel with the one io_uring_enter that also waits for
+ * completions. Receives take their buffer from a ring of provided buffers
+ * registered with the kernel, so an idle connection pins no memory, and
+ * the owner hands each buffer back once it has copied the bytes out.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+
+#define URING_GROUP 0 /* Buffer group of the provided buffers */
+
+typedef struct {
+  int fd;                       /* The ring */
+  unsigned *sq_head;            /* First request the kernel has not taken */
+  unsigned *sq_tail;            /* Requests published to the kernel */
+  unsigned sq_mask;             /* Submission entries - 1 */
+  unsigned sq_entries;          /* Submission entries */
+  unsigned sqe_tail;            /* Requests queued, published or not */
+  struct io_uring_sqe *sqes;    /* Submission entries */
+  unsigned *cq_head;            /* First completion not seen */
+  unsigned *cq_tail;            /* Completions posted by the kernel */
+  unsigned cq_mask;             /* Completion entries - 1 */
+  struct io_uring_cqe *cqes;    /* Completion entries */
+  struct io_uring_buf_ring *br; /* Provided buffers the kernel may take */
+  char *bufs;                   /* Their memory, nbufs of buf_size bytes */
+  unsigned nbufs;               /* Provided buffers, a power of two */
+  unsigned buf_size;            /* Bytes per provided buffer */
+  unsigned short br_tail;       /* Buffers handed to the kernel */
+  struct __kernel_timespec ts;  /* Interval of the last timeout queued */
+} uring_t;
+
+/* Set up r with at least entries submission entries */
+void uring_init(uring_t *r, unsigned entries);
+
+/* Register nbufs buffers of size bytes for receives to take */
+void uring_provide(uring_t *r, unsigned nbufs, unsigned size);
+
+/* Return the memory of provided buffer bid */
+char *uring_buf(uring_t *r, unsigned bid);
+
+/* Hand provided buffer bid back to the kernel */
+void uring_recycle(uring_t *r, unsigned bid);
+
+/* Queue a multishot accept on listenfd */
+void uring_accept(uring_t *r, int listenfd, unsigned long long data);
+
+/* Queue a receive on fd into a provided buffer */
+void uring_recv(uring_t *r, int fd, unsigned long long data);
+
+/* Queue a send of len bytes; link holds back the next request until done */
+void uring_send(uring_t *r, int fd, void *buf, size_t len, int link,
+                unsigned long long data);
+
+/* Queue a one-shot wait for fd to become readable */
+void uring_poll(uring_t *r, int fd, unsigned long long data);
+
+/* Queue a timeout that completes after ms milliseconds */
+void uring_timeout(uring_t *r, long ms, unsigned long long data);
+
+/* Queue the cancellation of the request queued with target */
+void uring_cancel(uring_t *r, unsigned long long target,
+                  unsigned long long data);
+
+/* Submit what is queued and wait until a completion is posted */
+void uring_wait(uring_t *r);
+
+/* Return the first completion not seen, or NULL if there is none */
+struct io_uring_cqe *uring_peek(uring_t *r);
+
+/* Mark the completion uring_peek returned as seen */
+void uring_seen(uring_t *r);
+
+#endif /* __URING_H__ */
@@ -0,0 +1,163 @@
+/*
+ * affinity.c - Pinning server threads to cores (see affinity.h)
+ *
+ * The cpu_set_t macros need _GNU_SOURCE, which csapp.h does not build
+ * with, so the mask is kept by hand and set with the system call, which
+ * pins the calling thread alone. Memory policies go through the system
+ * call as well, so that no libnuma is needed.
+ */
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "affinity.h"
+
+#define MAXCPUS 1024 /* Cores a list may name, as CPU_SETSIZE */
+#define MASK_BITS (8 * sizeof(unsigned long)) /* Cores per mask word */
+#define MPOL_INTERLEAVE 3 /* Policy of linux/mempolicy.h: pages round robin */
+#define NODES_ONLINE "/sys/devices/system/node/online" /* "0-3" */
+
+static int parse_cpus(char *s, char *mask);    /* Marks the cores of "0-3,8" */
+static int parse_irqs(char *name, char *mask); /* Marks the cores of IRQs */
+
+/* Parse spec into l; returns 0 if it is malformed or names no core */
+int affinity_parse(char *spec, cpu_list *l) {
+  char mask[MAXCPUS] = {0};
+
+  if (!(strncmp(spec, "irq:", 4) ? parse_cpus(spec, mask)
+                                 : parse_irqs(spec + 4, mask)))
+    return 0;
+  l->n = 0;
+  l->cpus = Malloc(MAXCPUS * sizeof(int));
+  for (int cpu = 0; cpu < MAXCPUS; cpu++)
+    if (mask[cpu])
+      l->cpus[l->n++] = cpu;
+  return l->n > 0;
+}
+
+/* Pin the calling thread to every core of l */
+void affinity_pin(cpu_list *l) {
+  unsigned long set[MAXCPUS / MASK_BITS] = {0};
+
+  if (l->n == 0)
+    return;
+  for (int i = 0; i < l->n; i++)
+    set[l->cpus[i] / MASK_BITS] |= 1UL << (l->cpus[i] % MASK_BITS);
+  if (syscall(SYS_sched_setaffinity, 0, sizeof(set), set) < 0)
+    unix_error("sched_setaffinity error");
+}
+
+/* Pin the calling thread to core i of l, counting round the list */
+void affinity_pin_one(cpu_list *l, int i) {
+  cpu_list one;
+
+  if (l->n == 0)
+    return;
+  one.n = 1;
+  one.cpus = &l->cpus[i % l->n];
+  affinity_pin(&one);
+}
+
+/* Fill l with the cores the calling thread may run on now */
+void affinity_get(cpu_list *l) {
+  unsigned long set[MAXCPUS / MASK_BITS] = {0};
+
+  if (syscall(SYS_sched_getaffinity, 0, sizeof(set), set) < 0)
+    unix_error("sched_getaffinity error");
+  l->n = 0;
+  l->cpus = Malloc(MAXCPUS * sizeof(int));
+  for (int cpu = 0; cpu < MAXCPUS; cpu++)
+    if (set[cpu / MASK_BITS] >> (cpu % MASK_BITS) & 1)
+      l->cpus[l->n++] = cpu;
+}
+
+/*
+ * affinity_interleave - Spread the pages of the len bytes at addr round
+ * robin over the online memory nodes, for memory every core uses alike.
+ * It must come before the pages are first touched. With one node there is
+ * nothing to spread, and a kernel that refuses is left alone, as the
+ * placement is only a hint.
+ */
+void affinity_interleave(void *addr, size_t len) {
+  unsigned long nodes[MAXCPUS / MASK_BITS] = {0};
+  char mask[MAXCPUS] = {0}, list[MAXLINE];
+  unsigned long page = sysconf(_SC_PAGESIZE), start;
+  int n = 0;
+  FILE *fp;
+
+  if ((fp = fopen(NODES_ONLINE, "r")) == NULL)
+    return;
+  if (fgets(list, MAXLINE, fp) == NULL || !parse_cpus(list, mask)) {
+    fclose(fp);
+    return;
+  }
+  fclose(fp);
+  for (int node = 0; node < MAXCPUS; node++)
+    if (mask[node]) {
+      nodes[node / MASK_BITS] |= 1UL << (node % MASK_BITS);
+      n++;
+    }
+  if (n < 2 || len == 0)
+    return;
+  start = (unsigned long)addr & ~(page - 1);
+  syscall(SYS_mbind, start, (unsigned long)addr + len - start,
+          MPOL_INTERLEAVE, nodes, MAXCPUS, 0);
+}
+
+/* Mark in mask the cores of a list like "0-3,8"; returns 0 if malformed */
+static int parse_cpus(char *s, char *mask) {
+  long lo, hi;
+  char *end;
+
+  while (1) {
+    lo = hi = strtol(s, &end, 10);
+    if (end == s || lo < 0)
+      return 0;
+    if (*end == '-') {
+      s = end + 1;
+      hi = strtol(s, &end, 10);
+      if (end == s || hi < lo)
+        return 0;
+    }
+    if (hi >= MAXCPUS)
+      return 0;
+    while (lo <= hi)
+      mask[lo++] = 1;
+    if (*end == '\0' || *end == '\n')
+      return 1;
+    if (*end != ',')
+      return 0;
+    s = end + 1;
+  }
+}
+
+/*
+ * parse_irqs - Mark in mask the cores that handle the interrupts whose
+ * /proc/interrupts line names name. A line has a count per core, so it is
+ * read whole with getline. Returns 0 if no such interrupt has a core.
+ */
+static int parse_irqs(char *name, char *mask) {
+  char *line = NULL, path[64], cpus[MAXLINE];
+  size_t cap = 0;
+  FILE *fp, *list;
+  int irq, found = 0;
+
+  if (*name == '\0' || (fp = fopen("/proc/interrupts", "r")) == NULL)
+    return 0;
+  while (getline(&line, &cap, fp) > 0) {
+    if (sscanf(line, " %d:", &irq) != 1 ||
+        strstr(strchr(line, ':'), name) == NULL)
+      continue;
+    /* the cores it is delivered to, else the ones it may be */
+    sprintf(path, "/proc/irq/%d/effective_affinity_list", irq);
+    if ((list = fopen(path, "r")) == NULL) {
+      sprintf(path, "/proc/irq/%d/smp_affinity_list", irq);
+      if ((list = fopen(path, "r")) == NULL)
+        continue;
+    }
+    if (fgets(cpus, MAXLINE, list) != NULL && parse_cpus(cpus, mask))
+      found = 1;
+    fclose(list);
+  }
+  free(line);
+  fclose(fp);
+  return found;
+}
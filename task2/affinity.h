@@ -0,0 +1,34 @@
+/*
+ * affinity.h - Pinning server threads to cores
+ *
+ * A list of cores is given as "0-3,8" or as "irq:<name>", which stands
+ * for the cores that handle the interrupts of every /proc/interrupts line
+ * naming <name>, such as a NIC's queues. Threads that serve its sockets
+ * then run where the packets arrive. A pinned thread should allocate and
+ * first touch its own buffers, so that the kernel places them on the
+ * memory node of its core; memory all of them share is better interleaved.
+ */
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+typedef struct {
+  int n;     /* Cores in the list; 0 leaves threads unpinned */
+  int *cpus; /* Their numbers in ascending order */
+} cpu_list;
+
+/* Parse spec into l; returns 0 if it is malformed or names no core */
+int affinity_parse(char *spec, cpu_list *l);
+
+/* Pin the calling thread to every core of l */
+void affinity_pin(cpu_list *l);
+
+/* Pin the calling thread to core i of l, counting round the list */
+void affinity_pin_one(cpu_list *l, int i);
+
+/* Fill l with the cores the calling thread may run on now */
+void affinity_get(cpu_list *l);
+
+/* Spread the pages of len bytes at addr over the memory nodes */
+void affinity_interleave(void *addr, size_t len);
+
+#endif /* __AFFINITY_H__ */
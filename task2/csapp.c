@@ -358,6 +358,37 @@ int Select(int  n, fd_set *readfds, fd_set *writefds,
     return rc;
 }
 
+#ifdef __linux__
+int Epoll_create1(int flags) 
+{
+    int rc;
+
+    if ((rc = epoll_create1(flags)) < 0)
+	unix_error("Epoll_create1 error");
+    return rc;
+}
+
+void Epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) 
+{
+    if (epoll_ctl(epfd, op, fd, event) < 0)
+	unix_error("Epoll_ctl error");
+}
+
+int Epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+	       int timeout) 
+{
+    int rc;
+
+    /* A signal interrupting the wait is not an error; report no events */
+    if ((rc = epoll_wait(epfd, events, maxevents, timeout)) < 0) {
+	if (errno != EINTR)
+	    unix_error("Epoll_wait error");
+	rc = 0;
+    }
+    return rc;
+}
+#endif
+
 int Dup2(int fd1, int fd2) 
 {
     int rc;
@@ -778,6 +809,37 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writevn - Robustly write every byte of an iovec array (unbuffered).
+ *    Partial writes are resumed where they stopped, so the iov entries
+ *    are consumed in place.
+ */
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt) 
+{
+    size_t n = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) < 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	n += nwritten;
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return n;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -851,34 +913,87 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The buffered
+ *    bytes are scanned for the newline with memchr and copied in one
+ *    go rather than moved one rio_read call per character.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (nl == NULL && n + 1 < maxlen) {
+	if (rp->rio_cnt <= 0) {
+	    /* Let rio_read refill the buffer and hand over its first byte */
+	    if ((rc = rio_read(rp, bufp, 1)) < 0)
+		return -1;	  /* Error */
+	    else if (rc == 0)
+		break;		  /* EOF */
+	    n++;
+	    if (*bufp++ == '\n')
+		break;
+	    continue;
+	}
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlinep - Return the next text line without copying it (buffered).
+ *    *linep points into the rio buffer and stays valid until the next
+ *    read from rp; the line is not NUL-terminated. A line that does not
+ *    fit in the buffer comes back in RIO_BUFSIZE pieces.
+ */
+ssize_t rio_readlinep(rio_t *rp, char **linep) 
+{
+    ssize_t n, rc;
+    char *nl;
+
+    if (rp->rio_cnt < 0)	  /* Left over from a failed rio_read */
+	rp->rio_cnt = 0;
+    while (1) {
+	if ((nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt)) != NULL) {
+	    n = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	if ((n = rp->rio_cnt) == RIO_BUFSIZE)
+	    break;		  /* No newline in a full buffer */
+
+	/* Slide the partial line to the front and read more after it */
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+	rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		  RIO_BUFSIZE - rp->rio_cnt);
+	if (rc < 0) {
+	    if (errno != EINTR)	  /* Interrupted by sig handler return */
+		return -1;
+	} else if (rc == 0) {	  /* EOF */
+	    if (n == 0)
+		return 0;
+	    break;		  /* Last line has no newline */
+	} else
+	    rp->rio_cnt += rc;
+    }
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -897,6 +1012,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writevn(int fd, struct iovec *iov, int iovcnt) 
+{
+    if (rio_writevn(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writevn error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -920,6 +1041,15 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_readlinep(rio_t *rp, char **linep) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlinep(rp, linep)) < 0)
+	unix_error("Rio_readlinep error");
+    return rc;
+} 
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -930,6 +1060,8 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
  * 
  *     On error, returns -1 and sets errno.  
  */
+static int open_listenfd_opt(char *port, int reuseport);
+
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
     int clientfd;
@@ -971,6 +1103,22 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but several sockets may be
+ *     bound to the same port and the kernel spreads incoming connections
+ *     across them (SO_REUSEPORT).
+ */
+int open_listenfd_reuseport(char *port) 
+{
+    return open_listenfd_opt(port, 1);
+}
+
+static int open_listenfd_opt(char *port, int reuseport) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, optval=1;
@@ -991,6 +1139,11 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+#ifdef SO_REUSEPORT
+        if (reuseport)
+            Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval , sizeof(int));
+#endif
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1010,7 +1163,6 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1033,6 +1185,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,232 @@
+/*
+ * handoff.c - Hot upgrades of the stock servers (see handoff.h)
+ *
+ * The handoff is one message holding a header and the listeners, followed
+ * by the stock records with their trade counts, all in network order as in
+ * the binary protocol. A predecessor that was already stopping on a signal
+ * sends nothing and leaves the socket open until it exits, and one that
+ * dies before it is done closes it; either way the successor falls back to
+ * stock.txt and the journal, which then hold every trade answered.
+ */
+#include <sys/un.h>
+#include "csapp.h"
+#include "stop.h"
+#include "handoff.h"
+
+typedef struct {
+  uint32_t nfds;  /* Listeners passed along with the header */
+  uint32_t count; /* Stock records that follow */
+} handoff_hdr;
+
+typedef struct {
+  bin_stock stock;  /* ID, stocks left and price */
+  uint32_t version; /* Trades that led to the stocks left */
+} handoff_rec;
+
+static void unix_addr(char *path, struct sockaddr_un *addr); /* Fills addr */
+static void handoff_send(int s, bin_stock *rec, int count,
+                         unsigned *version); /* Passes the stocks to s */
+static void *handoff_thread(void *vargp); /* Waits for the successor */
+
+static int *listeners; /* Listening sockets a successor gets */
+static int nlisteners; /* Number of them */
+static bin_stock *(*cutover)(int *, unsigned **); /* Stops trading */
+static sem_t sent;     /* Posted once the successor has the stocks */
+
+/* Connect to the server on path, if any; returns the socket, or -1 */
+int handoff_connect(char *path) {
+  struct sockaddr_un addr;
+  int s = Socket(AF_UNIX, SOCK_STREAM, 0);
+
+  unix_addr(path, &addr);
+  if (connect(s, (SA *)&addr, sizeof(addr)) < 0) { /* nobody to take over */
+    Close(s);
+    return -1;
+  }
+  return s;
+}
+
+/*
+ * handoff_listen - Bind path, replacing the socket of a predecessor, and
+ * start the thread that waits there for a successor, who gets the nfds
+ * listeners of fds and the stocks fn returns.
+ */
+void handoff_listen(char *path, int *fds, int nfds,
+                    bin_stock *(*fn)(int *count, unsigned **version)) {
+  struct sockaddr_un addr;
+  pthread_t tid;
+  int listenfd = Socket(AF_UNIX, SOCK_STREAM, 0);
+
+  listeners = fds;
+  nlisteners = nfds < HANDOFF_MAXFDS ? nfds : HANDOFF_MAXFDS;
+  cutover = fn;
+  Sem_init(&sent, 0, 0);
+  unix_addr(path, &addr);
+  if (unlink(path) < 0 && errno != ENOENT)
+    unix_error("handoff unlink error");
+  Bind(listenfd, (SA *)&addr, sizeof(addr));
+  Listen(listenfd, 1);
+  Pthread_create(&tid, NULL, handoff_thread, (void *)(long)listenfd);
+}
+
+/*
+ * handoff_recv - Take the listeners, at most HANDOFF_MAXFDS, into fds and
+ * their number into *nfds, and return the stocks, Malloc'd, with their
+ * number in *count and, unless version is NULL, their trade counts in a
+ * Malloc'd *version. Returns NULL, keeping any listeners received, once
+ * the predecessor closed s without sending the stocks, which it does only
+ * after its last checkpoint. Closes s.
+ */
+bin_stock *handoff_recv(int s, int *fds, int *nfds, int *count,
+                        unsigned **version) {
+  char ctl[CMSG_SPACE(HANDOFF_MAXFDS * sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct iovec iov;
+  handoff_hdr hdr;
+  handoff_rec *recs;
+  bin_stock *rec;
+  ssize_t n;
+
+  iov.iov_base = &hdr;
+  iov.iov_len = sizeof(hdr);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+  *nfds = 0;
+  while ((n = recvmsg(s, &msg, 0)) < 0 && errno == EINTR)
+    ;
+  for (cm = CMSG_FIRSTHDR(&msg); n > 0 && cm != NULL;
+       cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      *nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+    }
+  }
+  if (n != sizeof(hdr)) {
+    Close(s);
+    return NULL;
+  }
+
+  *count = ntohl(hdr.count);
+  recs = Malloc((*count > 0 ? *count : 1) * sizeof(handoff_rec));
+  if (rio_readn(s, recs, *count * sizeof(handoff_rec)) !=
+      (ssize_t)(*count * sizeof(handoff_rec))) {
+    Free(recs);
+    Close(s);
+    return NULL;
+  }
+  rec = Malloc((*count > 0 ? *count : 1) * sizeof(bin_stock));
+  if (version != NULL)
+    *version = Malloc((*count > 0 ? *count : 1) * sizeof(unsigned));
+  for (int i = 0; i < *count; i++) {
+    rec[i].id = ntohl(recs[i].stock.id);
+    rec[i].left = ntohl(recs[i].stock.left);
+    rec[i].price = ntohl(recs[i].stock.price);
+    if (version != NULL)
+      (*version)[i] = ntohl(recs[i].version);
+  }
+  Free(recs);
+  Close(s);
+  return rec;
+}
+
+/* Wait until the successor that stopped the server has the stocks */
+void handoff_finish(void) {
+  if (stop_successor() >= 0)
+    P(&sent);
+}
+
+/* Fill addr with the Unix socket address of path */
+static void unix_addr(char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+    app_error("handoff path too long");
+  strcpy(addr->sun_path, path);
+}
+
+/*
+ * handoff_send - Pass the listeners and the count stocks of rec, with the
+ * trade counts of version, or none if it is NULL, to the successor on s,
+ * and close s. A successor gone meanwhile is reported; the journal has
+ * every trade, so one started again falls back to it.
+ */
+static void handoff_send(int s, bin_stock *rec, int count, unsigned *version) {
+  char ctl[CMSG_SPACE(HANDOFF_MAXFDS * sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct iovec iov;
+  handoff_hdr hdr;
+  handoff_rec *recs = Malloc((count > 0 ? count : 1) * sizeof(handoff_rec));
+  char *p = (char *)recs;
+  size_t left = count * sizeof(handoff_rec);
+  ssize_t n;
+
+  hdr.nfds = htonl(nlisteners);
+  hdr.count = htonl(count);
+  iov.iov_base = &hdr;
+  iov.iov_len = sizeof(hdr);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nlisteners > 0) {
+    msg.msg_control = ctl;
+    msg.msg_controllen = CMSG_SPACE(nlisteners * sizeof(int));
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(nlisteners * sizeof(int));
+    memcpy(CMSG_DATA(cm), listeners, nlisteners * sizeof(int));
+  }
+  for (int i = 0; i < count; i++) {
+    recs[i].stock.id = htonl(rec[i].id);
+    recs[i].stock.left = htonl(rec[i].left);
+    recs[i].stock.price = htonl(rec[i].price);
+    recs[i].version = htonl(version != NULL ? version[i] : 0);
+  }
+
+  n = sendmsg(s, &msg, MSG_NOSIGNAL);
+  while (n >= 0 && left > 0) {
+    if ((n = send(s, p, left, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+      n = 0;
+    } else if (n > 0) {
+      p += n;
+      left -= n;
+    }
+  }
+  if (n < 0)
+    fprintf(stderr, "handoff error: %s\n", strerror(errno));
+  Free(recs);
+  Close(s);
+}
+
+/*
+ * handoff_thread - Wait for the first successor, stop the server for it,
+ * and once the cutover has stopped trading, hand it the listeners, which
+ * a stopping server keeps open for it, and the stocks. If a signal
+ * stopped the server first, the successor's socket is left open until
+ * the process exits, so that it only falls back to stock.txt once the
+ * last checkpoint is written.
+ */
+static void *handoff_thread(void *vargp) {
+  int listenfd = (int)(long)vargp, s, count;
+  unsigned *version;
+  bin_stock *rec;
+
+  Pthread_detach(pthread_self());
+  s = Accept(listenfd, NULL, NULL);
+  Close(listenfd);
+  if (stop_handoff(s)) {
+    rec = cutover(&count, &version);
+    handoff_send(s, rec, count, version);
+    Free(rec);
+    Free(version);
+    printf("handed %d stocks off to a successor\n", count);
+    fflush(stdout);
+    V(&sent);
+  }
+  return NULL;
+}
@@ -0,0 +1,117 @@
+/*
+ * index_bench - Lookup cost of the AVL tree against the flat ID indexes.
+ *
+ * Builds a table of n stocks with IDs 1..n, as stock.txt numbers them, and
+ * looks up random IDs through query_stock of stockserver.c, a hash index
+ * and a direct index. The tree is built perfectly balanced, the best an
+ * AVL tree can do, with one malloc per node as insert_stock does.
+ *
+ * usage: index_bench
+ */
+#include "csapp.h"
+#include "stockindex.h"
+
+#define LOOKUPS 4000000 /* Lookups per measurement */
+#define ROUNDS 3        /* Measurements per structure; the best one counts */
+
+typedef struct {
+  int ID;    /* Stock ID */
+  int price; /* The price of this stock */
+  uint64_t state __attribute__((aligned(64))); /* As in stockserver.c */
+} item;
+
+typedef struct node {
+  item *stock;        /* The stock */
+  struct node *left;  /* The left subtree of this node */
+  struct node *right; /* The right subtree of this node */
+  int height;         /* Height of the subtree */
+} node;
+
+static int sizes[] = {10, 10000, 1000000};
+
+/* Build a balanced tree over items[lo..hi] */
+node *build(item *items, int lo, int hi) {
+  node *n;
+  int mid = lo + (hi - lo) / 2, lh, rh;
+
+  if (lo > hi)
+    return NULL;
+  n = Malloc(sizeof(node));
+  n->stock = &items[mid];
+  n->left = build(items, lo, mid - 1);
+  n->right = build(items, mid + 1, hi);
+  lh = n->left ? n->left->height : 0;
+  rh = n->right ? n->right->height : 0;
+  n->height = 1 + (lh > rh ? lh : rh);
+  return n;
+}
+
+/* The lookup of stockserver.c */
+item *query_stock(node *tree, int id) {
+  if (tree == NULL)
+    return NULL;
+
+  node *current = tree;
+  while (current != NULL) {
+    if (id == current->stock->ID)
+      return current->stock;
+    else if (id < current->stock->ID)
+      current = current->left;
+    else
+      current = current->right;
+  }
+  return NULL;
+}
+
+/* Look up every ID of keys through the tree or ix; returns ns per lookup */
+double run(node *tree, stock_index *ix, int *keys) {
+  struct timespec start, end;
+  double ns, best = 0;
+  long found;
+
+  for (int r = 0; r < ROUNDS; r++) {
+    found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOOKUPS; i++)
+      found += (tree ? query_stock(tree, keys[i])
+                     : (item *)index_find(ix, keys[i])) != NULL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (found != LOOKUPS)
+      app_error("lookup missed");
+    ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+         LOOKUPS;
+    if (r == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  int *keys = Malloc(LOOKUPS * sizeof(int));
+  stock_index hash, direct;
+  item *items = NULL;
+  node *tree;
+  int n;
+
+  printf("%d random lookups, best of %d passes\n", LOOKUPS, ROUNDS);
+  printf("%8s %12s %12s %12s\n", "stocks", "tree ns", "hash ns", "direct ns");
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    n = sizes[s];
+    if (posix_memalign((void **)&items, 64, n * sizeof(item)) != 0)
+      app_error("posix_memalign error");
+    index_init(&hash, INDEX_HASH, n, 1, n);
+    index_init(&direct, INDEX_DIRECT, n, 1, n);
+    for (int i = 0; i < n; i++) {
+      items[i].ID = i + 1;
+      index_insert(&hash, i + 1, &items[i]);
+      index_insert(&direct, i + 1, &items[i]);
+    }
+    tree = build(items, 0, n - 1);
+    for (int i = 0; i < LOOKUPS; i++)
+      keys[i] = rand() % n + 1;
+
+    printf("%8d %12.2f %12.2f %12.2f\n", n, run(tree, NULL, keys),
+           run(NULL, &hash, keys), run(NULL, &direct, keys));
+  }
+  exit(0);
+}
@@ -0,0 +1,319 @@
+/*
+ * journal.c - Append-only trade journal of the stock servers (see journal.h)
+ */
+#include "csapp.h"
+#include "journal.h"
+
+#define JOURNAL_RECLEN 48 /* Room for one "<id> <left> <version>\n" record */
+
+static void journal_write(char *buf, size_t len); /* Makes len bytes durable */
+static void journal_commit(void);        /* Writes out the pending records */
+static void commit_locked(void);         /* journal_commit, cmutex held */
+static void replay_file(
+    char *name, void (*apply)(int, int, unsigned)); /* Replays one file */
+static void *journal_thread(void *vargp); /* Group commits */
+static void *flusher_thread(void *vargp); /* Checkpoints when due */
+
+/* The read end of one journal_notify pipe is watched by an event loop */
+typedef struct watcher {
+  int fd;               /* Write end of the pipe */
+  struct watcher *next; /* Watcher registered before */
+} watcher;
+
+static sem_t cmutex;       /* Serializes commits with rotation */
+static sem_t jmutex;       /* Protects dirty, appended and the pending records */
+static sem_t due;          /* Posted when dirty reaches dirty_max */
+static sem_t queued;       /* Posted when a batch starts and commit_ms is 0 */
+static sem_t dmutex;       /* Protects durable and waiting */
+static sem_t woken;        /* Posted once per waiter a commit releases */
+static int jfd = -1;       /* Descriptor of JOURNAL_FILE; cmutex held */
+static char *jbuf;         /* Records appended since the last commit */
+static size_t jlen;        /* Bytes used in jbuf */
+static size_t jcap;        /* Bytes allocated for jbuf */
+static char *spare;        /* The buffer of the last commit, reused */
+static size_t spare_cap;   /* Bytes allocated for spare */
+static int commit_ms;      /* Group-commit window; 0 commits every record */
+static int checkpoint_s;   /* Seconds between checkpoints; 0 never */
+static int dirty;          /* Records appended since the last rotation */
+static int dirty_max;      /* Records that force a checkpoint; 0 never */
+static unsigned long appended; /* Number of the last record appended */
+static unsigned long durable;  /* Number of the last record on disk */
+static int waiting;            /* Threads in journal_wait not released yet */
+static watcher *watchers;      /* Pipes of journal_notify, newest first */
+static void (*checkpoint)(void); /* Writes stock.txt for the server */
+
+/* Apply the records of the last run, those of an unfinished checkpoint first */
+void journal_replay(void (*apply)(int id, int left, unsigned version)) {
+  replay_file(JOURNAL_PREV, apply);
+  replay_file(JOURNAL_FILE, apply);
+}
+
+/*
+ * journal_open - Open the journal for appending and start the committer
+ * and the flusher. The replayed records are folded into stock.txt by a
+ * first checkpoint before any trade can be appended.
+ */
+void journal_open(int commit, int interval, int max, void (*fn)(void)) {
+  pthread_t tid;
+
+  Sem_init(&cmutex, 0, 1);
+  Sem_init(&jmutex, 0, 1);
+  Sem_init(&due, 0, 0);
+  Sem_init(&queued, 0, 0);
+  Sem_init(&dmutex, 0, 1);
+  Sem_init(&woken, 0, 0);
+  commit_ms = commit;
+  checkpoint_s = interval;
+  dirty_max = max;
+  checkpoint = fn;
+  jfd = Open(JOURNAL_FILE, O_WRONLY | O_APPEND | O_CREAT, DEF_MODE);
+  checkpoint();
+  Pthread_create(&tid, NULL, journal_thread, NULL);
+  Pthread_create(&tid, NULL, flusher_thread, NULL);
+}
+
+/*
+ * journal_append - Record that stock id now has left shares after its
+ * version-th trade, and return the number of the record. It is only
+ * buffered: the trade may be answered once journal_durable says so.
+ */
+unsigned long journal_append(int id, int left, unsigned version) {
+  char rec[JOURNAL_RECLEN];
+  int n = sprintf(rec, "%d %d %u\n", id, left, version);
+  unsigned long seq;
+
+  P(&jmutex);
+  if (jlen + n > jcap) {
+    jcap = jcap ? 2 * jcap : MAXLINE;
+    jbuf = Realloc(jbuf, jcap);
+  }
+  if (jlen == 0 && commit_ms == 0)
+    V(&queued); /* a batch starts: wake the committer */
+  memcpy(jbuf + jlen, rec, n);
+  jlen += n;
+  seq = ++appended;
+  if (++dirty == dirty_max)
+    V(&due); /* wake the flusher */
+  V(&jmutex);
+  return seq;
+}
+
+/* Return nonzero once record seq, and so every one before it, is on disk */
+int journal_durable(unsigned long seq) {
+  return __atomic_load_n(&durable, __ATOMIC_ACQUIRE) >= seq;
+}
+
+/* Wait until record seq is on disk */
+void journal_wait(unsigned long seq) {
+  P(&dmutex);
+  while (durable < seq) {
+    waiting++;
+    V(&dmutex);
+    P(&woken);
+    P(&dmutex);
+  }
+  V(&dmutex);
+}
+
+/*
+ * journal_notify - Return the read end of a pipe that turns readable after
+ * every commit, for an event loop holding replies back. The loop reads it
+ * empty; a commit finding it full skips it, as a byte is already there.
+ */
+int journal_notify(void) {
+  watcher *w = Malloc(sizeof(watcher));
+  int fds[2];
+
+  if (pipe(fds) < 0)
+    unix_error("journal pipe error");
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+  w->fd = fds[1];
+  P(&jmutex);
+  w->next = watchers;
+  __atomic_store_n(&watchers, w, __ATOMIC_RELEASE);
+  V(&jmutex);
+  return fds[0];
+}
+
+/*
+ * journal_rotate - Move the committed records aside and start an empty
+ * journal. A trade appended before the switch changed the table before
+ * the caller copies it; any later one lands in the new journal.
+ */
+void journal_rotate(void) {
+  char buf[MAXBUF];
+  ssize_t n;
+  int fd;
+
+  P(&cmutex);
+  commit_locked();
+  P(&jmutex);
+  dirty = 0;
+  V(&jmutex);
+  /* Appends only touch the buffer, so they go on while the files change */
+  if (access(JOURNAL_PREV, F_OK) < 0) {
+    Close(jfd);
+    if (rename(JOURNAL_FILE, JOURNAL_PREV) < 0)
+      unix_error("journal rename error");
+    jfd = Open(JOURNAL_FILE, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC,
+               DEF_MODE);
+  } else {
+    /* A checkpoint died before retiring its records; they are still due */
+    fd = Open(JOURNAL_FILE, O_RDONLY, 0);
+    Close(jfd);
+    jfd = Open(JOURNAL_PREV, O_WRONLY | O_APPEND, 0);
+    while ((n = Read(fd, buf, MAXBUF)) > 0)
+      journal_write(buf, n);
+    Close(fd);
+    Close(jfd);
+    jfd = Open(JOURNAL_FILE, O_WRONLY | O_APPEND | O_TRUNC, 0);
+  }
+  V(&cmutex);
+}
+
+/* Drop the records moved aside by journal_rotate; stock.txt holds them */
+void journal_retire(void) {
+  if (unlink(JOURNAL_PREV) < 0 && errno != ENOENT)
+    unix_error("journal unlink error");
+}
+
+/*
+ * journal_flush - Commit the pending records, and every later one as soon
+ * as the committer gets to it, for a server on its way out, so that the
+ * replies it still holds need not wait out the window.
+ */
+void journal_flush(void) {
+  P(&cmutex);
+  commit_locked();
+  P(&jmutex);
+  commit_ms = 0;
+  V(&jmutex);
+  V(&queued);
+  V(&cmutex);
+}
+
+/* Write len bytes to the journal and wait until they are on disk */
+static void journal_write(char *buf, size_t len) {
+  if (rio_writen(jfd, buf, len) < 0 || fdatasync(jfd) < 0)
+    unix_error("journal write error");
+}
+
+/* Write every pending record with one write and one fdatasync */
+static void journal_commit(void) {
+  P(&cmutex);
+  commit_locked();
+  V(&cmutex);
+}
+
+/*
+ * commit_locked - Swap in the spare buffer and write out the full one.
+ * cmutex keeps the flusher's rotation away, so the buffer being written
+ * needs no lock while appends go on into the other one. Once it is on
+ * disk, the threads waiting on its records are released and the event
+ * loops told.
+ */
+static void commit_locked(void) {
+  char *buf;
+  size_t len, cap;
+  unsigned long upto;
+  watcher *w;
+  int n;
+
+  P(&jmutex);
+  buf = jbuf;
+  len = jlen;
+  cap = jcap;
+  upto = appended;
+  jbuf = spare;
+  jcap = spare_cap;
+  jlen = 0;
+  spare = buf;
+  spare_cap = cap;
+  V(&jmutex);
+  if (len == 0)
+    return;
+  journal_write(buf, len);
+
+  P(&dmutex);
+  __atomic_store_n(&durable, upto, __ATOMIC_RELEASE);
+  n = waiting;
+  waiting = 0;
+  V(&dmutex);
+  while (n-- > 0)
+    V(&woken);
+  for (w = __atomic_load_n(&watchers, __ATOMIC_ACQUIRE); w != NULL;
+       w = w->next)
+    if (write(w->fd, "", 1) < 0 && errno != EAGAIN)
+      unix_error("journal notify error");
+}
+
+/* Apply the records of name; a torn last record is cut off */
+static void replay_file(char *name, void (*apply)(int, int, unsigned)) {
+  char line[MAXLINE];
+  int id, left;
+  unsigned version;
+  off_t good = 0;
+  size_t n;
+  FILE *fp;
+
+  if ((fp = fopen(name, "r")) == NULL)
+    return;
+  while (fgets(line, MAXLINE, fp) != NULL) {
+    n = strlen(line);
+    if (line[n - 1] != '\n' ||
+        sscanf(line, "%d %d %u", &id, &left, &version) != 3)
+      break;
+    apply(id, left, version);
+    good += n;
+  }
+  Fclose(fp);
+  if (truncate(name, good) < 0)
+    unix_error("journal truncate error");
+}
+
+/*
+ * journal_thread - The committer: one group commit every commit_ms, or,
+ * with commit_ms 0, one as soon as a record waits, taking along all that
+ * were appended while the last one was on its way to disk.
+ */
+static void *journal_thread(void *vargp) {
+  int window;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    P(&jmutex);
+    window = commit_ms; /* journal_flush may zero it */
+    V(&jmutex);
+    if (window > 0)
+      usleep(window * 1000);
+    else
+      P(&queued);
+    journal_commit();
+  }
+  return NULL;
+}
+
+/* The flusher: checkpoints every checkpoint_s or once dirty_max is hit */
+static void *flusher_thread(void *vargp) {
+  struct timespec deadline;
+  int pending;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    if (checkpoint_s > 0) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += checkpoint_s;
+      while (sem_timedwait(&due, &deadline) < 0 && errno == EINTR)
+        ;
+    } else {
+      P(&due);
+    }
+    P(&jmutex);
+    pending = dirty;
+    V(&jmutex);
+    if (pending > 0) /* nothing to write after a quiet interval */
+      checkpoint();
+  }
+  return NULL;
+}
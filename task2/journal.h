@@ -0,0 +1,60 @@
+/*
+ * journal.h - Append-only trade journal of the stock servers
+ *
+ * Every trade appends one "<id> <left> <version>\n" record holding the
+ * stock's new count, so replaying a record twice is harmless. The version
+ * orders the records of one stock for servers that append them without
+ * holding the stock's lock; the others may pass 0 and rely on file order.
+ * Records are group committed: a committer thread writes whatever
+ * accumulated every commit_ms milliseconds with a single write and
+ * fdatasync, or, with a commit_ms of 0, as soon as the last commit is done.
+ * journal_append only buffers and numbers a record. A server answers the
+ * trade once journal_durable or journal_wait says the record is on disk,
+ * so a crash loses no trade a client was told of, and no lock of the
+ * server is ever held across a disk write.
+ *
+ * A separate flusher thread calls the server's checkpoint function every
+ * checkpoint_s seconds, or as soon as dirty_max records piled up, so the
+ * rewrite of stock.txt never holds up a commit. The checkpoint copies the
+ * table between journal_rotate and journal_retire. On startup stock.txt
+ * is loaded and both journal files are replayed over it.
+ */
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#define JOURNAL_FILE "stock.journal"     /* Records since the checkpoint */
+#define JOURNAL_PREV "stock.journal.old" /* Records of a checkpoint in flight */
+#define JOURNAL_COMMIT_MS 10             /* Default group-commit window */
+#define JOURNAL_CHECKPOINT_S 60          /* Default checkpoint interval */
+#define JOURNAL_DIRTY_MAX 10000          /* Default records per checkpoint */
+
+/* Apply the records left by the last run; call before journal_open */
+void journal_replay(void (*apply)(int id, int left, unsigned version));
+
+/* Open the journal, take a first checkpoint and start the threads */
+void journal_open(int commit_ms, int checkpoint_s, int dirty_max,
+                  void (*checkpoint)(void));
+
+/* Record that stock id now has left shares after its version-th trade;
+ * returns the number of the record */
+unsigned long journal_append(int id, int left, unsigned version);
+
+/* Return nonzero once record seq is on disk; 0 is always */
+int journal_durable(unsigned long seq);
+
+/* Wait until record seq is on disk */
+void journal_wait(unsigned long seq);
+
+/* Return a descriptor that turns readable after each commit; read it empty */
+int journal_notify(void);
+
+/* Start a new journal file; take the table copy of a checkpoint after it */
+void journal_rotate(void);
+
+/* Drop the records a finished checkpoint made redundant */
+void journal_retire(void);
+
+/* Commit the pending records, and every later one without a window */
+void journal_flush(void);
+
+#endif /* __JOURNAL_H__ */
@@ -0,0 +1,216 @@
+/*
+ * mpmc.c - Bounded lock-free MPMC queue of ints (see mpmc.h)
+ *
+ * Cell i starts with seq i. A push at position pos needs seq == pos and
+ * leaves pos + 1; a pop at pos needs pos + 1 and leaves pos + cells, the
+ * position the next lap pushes at. A thread that finds its cell not ready
+ * yet rereads the position, since another one claimed it first.
+ *
+ * Parking: a waiter counts itself in the lot, looks at the queue once more
+ * and only then sleeps. Whoever makes progress for the other side fences,
+ * and if the lot counts a sleeper, takes it off the count and posts once.
+ * The fences on both sides make sure that either the waiter sees the new
+ * item or the pusher sees the waiter.
+ */
+#include "csapp.h"
+#include "mpmc.h"
+
+#define MPMC_SPIN 64 /* Tries before a thread parks */
+
+/* Make q an empty queue of at least n cells */
+void mpmc_init(mpmc_t *q, int n) {
+  unsigned long size = 2;
+  int rc;
+
+  while (size < (unsigned long)n)
+    size *= 2;
+  rc = posix_memalign((void **)&q->cells, MPMC_ALIGN, size * sizeof(mpmc_cell));
+  if (rc != 0)
+    posix_error(rc, "posix_memalign error");
+  for (unsigned long i = 0; i < size; i++)
+    q->cells[i].seq = i;
+  q->mask = size - 1;
+  q->head = q->tail = 0;
+  mpmc_lot_init(&q->poppers);
+  mpmc_lot_init(&q->pushers);
+}
+
+/* Free the cells of q */
+void mpmc_deinit(mpmc_t *q) { Free(q->cells); }
+
+/* Push item unless q is full; returns 0 if it was */
+int mpmc_try_push(mpmc_t *q, int item) {
+  unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  mpmc_cell *c;
+  long diff;
+
+  while (1) {
+    c = &q->cells[pos & q->mask];
+    diff = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return 0; /* the cell still holds the item of the last lap */
+    } else {
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+  }
+  c->item = item;
+  __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+  mpmc_lot_wake(&q->poppers);
+  return 1;
+}
+
+/* Pop the first item into *item unless q is empty; returns 0 if it was */
+int mpmc_try_pop(mpmc_t *q, int *item) {
+  unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  mpmc_cell *c;
+  long diff;
+
+  while (1) {
+    c = &q->cells[pos & q->mask];
+    diff = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return 0; /* nothing pushed at pos yet */
+    } else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  *item = c->item;
+  __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+  mpmc_lot_wake(&q->pushers);
+  return 1;
+}
+
+/* Push item, waiting while q is full */
+void mpmc_push(mpmc_t *q, int item) {
+  while (1) {
+    for (int i = 0; i < MPMC_SPIN; i++)
+      if (mpmc_try_push(q, item))
+        return;
+    mpmc_lot_enter(&q->pushers);
+    if (mpmc_try_push(q, item)) {
+      mpmc_lot_leave(&q->pushers);
+      return;
+    }
+    mpmc_lot_sleep(&q->pushers, NULL);
+  }
+}
+
+/* Pop and return the first item, waiting while q is empty */
+int mpmc_pop(mpmc_t *q) {
+  int item;
+
+  while (1) {
+    for (int i = 0; i < MPMC_SPIN; i++)
+      if (mpmc_try_pop(q, &item))
+        return item;
+    mpmc_lot_enter(&q->poppers);
+    if (mpmc_try_pop(q, &item)) {
+      mpmc_lot_leave(&q->poppers);
+      return item;
+    }
+    mpmc_lot_sleep(&q->poppers, NULL);
+  }
+}
+
+/* Pop the first item into *item, waiting up to ms; returns 0 on timeout */
+int mpmc_timed_pop(mpmc_t *q, int ms, int *item) {
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (1) {
+    for (int i = 0; i < MPMC_SPIN; i++)
+      if (mpmc_try_pop(q, item))
+        return 1;
+    mpmc_lot_enter(&q->poppers);
+    if (mpmc_try_pop(q, item)) {
+      mpmc_lot_leave(&q->poppers);
+      return 1;
+    }
+    if (!mpmc_lot_sleep(&q->poppers, &deadline)) {
+      mpmc_lot_leave(&q->poppers);
+      return mpmc_try_pop(q, item);
+    }
+  }
+}
+
+/* Return the number of items in q; a hint while others use it */
+int mpmc_count(mpmc_t *q) {
+  unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  long n = (long)(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - tail);
+
+  return n > 0 ? (int)n : 0;
+}
+
+/* Make l an empty lot */
+void mpmc_lot_init(mpmc_lot *l) {
+  l->sleepers = 0;
+  Sem_init(&l->wake, 0, 0);
+}
+
+/* Count the caller as a sleeper before it looks at the queue once more */
+void mpmc_lot_enter(mpmc_lot *l) {
+  __atomic_add_fetch(&l->sleepers, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); /* count before the last look */
+}
+
+/*
+ * mpmc_lot_leave - Take the caller off the count without sleeping. If a waker
+ * got there first it has posted for the caller, and that post is taken.
+ */
+void mpmc_lot_leave(mpmc_lot *l) {
+  int s = __atomic_load_n(&l->sleepers, __ATOMIC_RELAXED);
+
+  while (1) {
+    if (s == 0) {
+      P(&l->wake);
+      return;
+    }
+    if (__atomic_compare_exchange_n(&l->sleepers, &s, s - 1, 1,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return;
+  }
+}
+
+/* Wake one sleeper of l, if it counts any; called after each push or pop */
+void mpmc_lot_wake(mpmc_lot *l) {
+  int s;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); /* progress before the count */
+  s = __atomic_load_n(&l->sleepers, __ATOMIC_RELAXED);
+  while (s > 0) {
+    if (__atomic_compare_exchange_n(&l->sleepers, &s, s - 1, 1,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      V(&l->wake);
+      return;
+    }
+  }
+}
+
+/* Sleep until woken, or until deadline if there is one; 0 on timeout */
+int mpmc_lot_sleep(mpmc_lot *l, struct timespec *deadline) {
+  if (deadline == NULL) {
+    P(&l->wake);
+    return 1;
+  }
+  while (sem_timedwait(&l->wake, deadline) < 0) {
+    if (errno == ETIMEDOUT)
+      return 0;
+    if (errno != EINTR)
+      unix_error("sem_timedwait error");
+  }
+  return 1;
+}
@@ -0,0 +1,76 @@
+/*
+ * mpmc.h - Bounded lock-free multi-producer multi-consumer queue of ints
+ *
+ * The queue is Vyukov's ring: every cell carries a sequence number that
+ * tells whether it is ready to be written or read at a given position.
+ * A push or a pop claims its position with one compare-and-swap on the
+ * queue's head or tail and never takes a lock. Threads that find the
+ * queue empty (or full) spin briefly and then park on a semaphore. The
+ * semaphore is only posted while a thread is parked, so a handoff between
+ * busy threads costs no system call.
+ */
+#ifndef __MPMC_H__
+#define __MPMC_H__
+
+#include <semaphore.h>
+
+#define MPMC_ALIGN 64 /* Head, tail and the parking lots get a line each */
+
+typedef struct {
+  unsigned long seq; /* Position the cell is ready for */
+  int item;          /* Item pushed at position seq - 1 */
+} mpmc_cell;
+
+/* Threads parked on one side of the queue, or waiting for any structure */
+typedef struct {
+  int sleepers; /* Parked threads no one has woken yet */
+  sem_t wake;   /* Posted once per thread woken */
+} mpmc_lot;
+
+typedef struct {
+  mpmc_cell *cells;   /* The ring, a power of two of cells */
+  unsigned long mask; /* Cells - 1 */
+  unsigned long head __attribute__((aligned(MPMC_ALIGN))); /* Next push */
+  unsigned long tail __attribute__((aligned(MPMC_ALIGN))); /* Next pop */
+  mpmc_lot poppers __attribute__((aligned(MPMC_ALIGN))); /* Wait for items */
+  mpmc_lot pushers __attribute__((aligned(MPMC_ALIGN))); /* Wait for room */
+} mpmc_t;
+
+/* Make q an empty queue of at least n cells */
+void mpmc_init(mpmc_t *q, int n);
+
+/* Free the cells of q */
+void mpmc_deinit(mpmc_t *q);
+
+/* Push item unless q is full; returns 0 if it was */
+int mpmc_try_push(mpmc_t *q, int item);
+
+/* Pop the first item into *item unless q is empty; returns 0 if it was */
+int mpmc_try_pop(mpmc_t *q, int *item);
+
+/* Push item, waiting while q is full */
+void mpmc_push(mpmc_t *q, int item);
+
+/* Pop and return the first item, waiting while q is empty */
+int mpmc_pop(mpmc_t *q);
+
+/* Pop the first item into *item, waiting up to ms; returns 0 on timeout */
+int mpmc_timed_pop(mpmc_t *q, int ms, int *item);
+
+/* Return the number of items in q; a hint while others use it */
+int mpmc_count(mpmc_t *q);
+
+/*
+ * The parking lot of the ring, for other lock-free structures too. A
+ * waiter calls mpmc_lot_enter, looks for work once more, and then either
+ * calls mpmc_lot_leave or sleeps with mpmc_lot_sleep. Whoever adds work
+ * calls mpmc_lot_wake afterwards.
+ */
+void mpmc_lot_init(mpmc_lot *l);  /* Make an empty lot */
+void mpmc_lot_enter(mpmc_lot *l); /* Count the caller as a sleeper */
+void mpmc_lot_leave(mpmc_lot *l); /* Take the caller off the count */
+void mpmc_lot_wake(mpmc_lot *l);  /* Wake one sleeper, if any */
+int mpmc_lot_sleep(mpmc_lot *l,
+                   struct timespec *deadline); /* 0 on timeout */
+
+#endif /* __MPMC_H__ */
@@ -0,0 +1,117 @@
+/*
+ * queue_bench - Handoff rate of the semaphore sbuf against the MPMC ring.
+ *
+ * One producer pushes HANDOFFS ints, as the master thread hands out
+ * descriptors, and n consumers pop them, as the workers do, for n = 1, 2,
+ * 4, ... max. The sbuf is the CS:APP one stockserver.c used, with three
+ * semaphores per operation; the ring is mpmc.c with SBUFSIZE cells either
+ * way. A consumer stops at a -1, which the producer pushes once per
+ * consumer after the work.
+ *
+ * usage: queue_bench [max_consumers]
+ */
+#include "csapp.h"
+#include "mpmc.h"
+
+#define SBUFSIZE 16      /* Slots, as in stockserver.c */
+#define HANDOFFS 1000000 /* Items per measurement */
+#define MAXTHREADS 64    /* Upper bound on max_consumers */
+
+/* The sbuf of stockserver.c before the ring */
+typedef struct {
+  int *buf;    /* Buffer array */
+  int n;       /* Maximum number of slots */
+  int front;   /* buf[(front+1)%n] is the first item */
+  int rear;    /* buf[rear%n] is the last item */
+  sem_t mutex; /* Protects accesses to buf */
+  sem_t slots; /* Counts available slots */
+  sem_t items; /* Counts available items */
+} sbuf_t;
+
+static sbuf_t sbuf;
+static mpmc_t ring;
+static int use_ring; /* Queue the current run hands off through */
+
+void sbuf_init(sbuf_t *sp, int n) {
+  sp->buf = Calloc(n, sizeof(int));
+  sp->n = n;
+  sp->front = sp->rear = 0;
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, n);
+  Sem_init(&sp->items, 0, 0);
+}
+
+void sbuf_insert(sbuf_t *sp, int item) {
+  P(&sp->slots);
+  P(&sp->mutex);
+  sp->buf[(++sp->rear) % (sp->n)] = item;
+  V(&sp->mutex);
+  V(&sp->items);
+}
+
+int sbuf_remove(sbuf_t *sp) {
+  int item;
+  P(&sp->items);
+  P(&sp->mutex);
+  item = sp->buf[(++sp->front) % (sp->n)];
+  V(&sp->mutex);
+  V(&sp->slots);
+  return item;
+}
+
+/* Consumer: pop until the -1 meant for it; returns how many it got */
+void *consumer(void *vargp) {
+  long got = 0;
+
+  while ((use_ring ? mpmc_pop(&ring) : sbuf_remove(&sbuf)) >= 0)
+    got++;
+  return (void *)got;
+}
+
+/* Hand HANDOFFS items to n consumers; returns handoffs per second */
+double run(int n) {
+  pthread_t tid[MAXTHREADS];
+  struct timespec start, end;
+  long total = 0;
+  void *got;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < n; i++)
+    Pthread_create(&tid[i], NULL, consumer, NULL);
+  for (int i = 0; i < HANDOFFS + n; i++) {
+    if (use_ring)
+      mpmc_push(&ring, i < HANDOFFS ? i : -1);
+    else
+      sbuf_insert(&sbuf, i < HANDOFFS ? i : -1);
+  }
+  for (int i = 0; i < n; i++) {
+    Pthread_join(tid[i], &got);
+    total += (long)got;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (total != HANDOFFS)
+    app_error("handoffs lost");
+  return HANDOFFS / ((end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char **argv) {
+  int max = argc > 1 ? atoi(argv[1]) : MAXTHREADS;
+  double rate[2];
+
+  if (max < 1 || max > MAXTHREADS) {
+    fprintf(stderr, "usage: %s [max_consumers <= %d]\n", argv[0], MAXTHREADS);
+    exit(0);
+  }
+  sbuf_init(&sbuf, SBUFSIZE);
+  mpmc_init(&ring, SBUFSIZE);
+  printf("%ld online cores, %d handoffs from one producer\n",
+         sysconf(_SC_NPROCESSORS_ONLN), HANDOFFS);
+  printf("%9s %16s %16s\n", "consumers", "sbuf handoffs/s", "ring handoffs/s");
+  for (int n = 1; n <= max; n *= 2) {
+    for (use_ring = 0; use_ring < 2; use_ring++)
+      rate[use_ring] = run(n);
+    printf("%9d %16.0f %16.0f\n", n, rate[0], rate[1]);
+  }
+  exit(0);
+}
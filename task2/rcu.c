@@ -0,0 +1,140 @@
+/*
+ * rcu.c - Read-copy-update reclamation for the stock servers (see rcu.h)
+ *
+ * Every reading thread owns a record whose ctr is 0 outside read sections
+ * and otherwise the grace period its outermost section began in. A writer
+ * publishes its copy, then starts a new grace period and waits out every
+ * record still in an older one. The fences on both sides make sure that a
+ * reader is either seen by the writer or sees the new copy.
+ */
+#include <sched.h>
+#include "csapp.h"
+#include "rcu.h"
+
+#define RCU_ALIGN 64 /* Records get a cache line each */
+
+typedef struct reader {
+  unsigned long ctr;   /* 0, or the grace period of the read section */
+  int nesting;         /* Read sections the thread is in */
+  int used;            /* Owned by a live thread */
+  struct reader *next; /* Next record of the registry */
+} reader_t;
+
+static void rcu_init(void);             /* Creates the locks and the key */
+static void release_reader(void *vargp); /* Frees a record at thread exit */
+static reader_t *register_reader(void); /* Claims a record for the thread */
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;        /* Releases the record of an exiting thread */
+static reader_t *readers;        /* Every record ever registered */
+static __thread reader_t *self;  /* Record of the calling thread */
+static unsigned long gp = 1;     /* Current grace period */
+static sem_t gp_mutex;           /* Serializes rcu_synchronize */
+static sem_t retire_mutex;       /* Protects retired */
+static void **retired;           /* Pointers waiting for a grace period */
+static int nretired, retired_cap; /* Entries used and allocated */
+
+/* Enter a read section; the calling thread registers on first use */
+void rcu_read_lock(void) {
+  if (self == NULL)
+    self = register_reader();
+  if (self->nesting++ == 0) {
+    __atomic_store_n(&self->ctr, __atomic_load_n(&gp, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); /* ctr before any shared read */
+  }
+}
+
+/* Leave the read section entered last */
+void rcu_read_unlock(void) {
+  if (--self->nesting == 0)
+    __atomic_store_n(&self->ctr, 0, __ATOMIC_RELEASE);
+}
+
+/* Free p once every read section running now has ended */
+void rcu_retire(void *p) {
+  Pthread_once(&once, rcu_init);
+  P(&retire_mutex);
+  if (nretired == retired_cap) {
+    retired_cap = retired_cap ? 2 * retired_cap : 64;
+    retired = Realloc(retired, retired_cap * sizeof(void *));
+  }
+  retired[nretired++] = p;
+  V(&retire_mutex);
+}
+
+/*
+ * rcu_synchronize - Wait for every read section running now, then free
+ * what was retired before the call. Later retirements wait for the next.
+ */
+void rcu_synchronize(void) {
+  void **batch;
+  int n;
+  unsigned long now, ctr;
+
+  Pthread_once(&once, rcu_init);
+  P(&gp_mutex);
+  P(&retire_mutex);
+  batch = retired;
+  n = nretired;
+  retired = NULL;
+  nretired = retired_cap = 0;
+  V(&retire_mutex);
+
+  now = __atomic_add_fetch(&gp, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); /* new copy before any ctr read */
+  for (reader_t *r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL;
+       r = r->next) {
+    while ((ctr = __atomic_load_n(&r->ctr, __ATOMIC_ACQUIRE)) != 0 &&
+           ctr < now)
+      sched_yield();
+  }
+  V(&gp_mutex);
+
+  for (int i = 0; i < n; i++)
+    Free(batch[i]);
+  Free(batch);
+}
+
+/* Create the locks and the key that releases records at thread exit */
+static void rcu_init(void) {
+  int rc;
+
+  Sem_init(&gp_mutex, 0, 1);
+  Sem_init(&retire_mutex, 0, 1);
+  if ((rc = pthread_key_create(&key, release_reader)) != 0)
+    posix_error(rc, "pthread_key_create error");
+}
+
+/* Hand the record of an exiting thread to the next thread that registers */
+static void release_reader(void *vargp) {
+  __atomic_store_n(&((reader_t *)vargp)->used, 0, __ATOMIC_RELEASE);
+}
+
+/* Claim a released record, or add a new one to the registry */
+static reader_t *register_reader(void) {
+  reader_t *r;
+  int unused, rc;
+
+  Pthread_once(&once, rcu_init);
+  for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL;
+       r = r->next) {
+    unused = 0;
+    if (__atomic_compare_exchange_n(&r->used, &unused, 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+      break;
+  }
+  if (r == NULL) {
+    if ((rc = posix_memalign((void **)&r, RCU_ALIGN, sizeof(reader_t))) != 0)
+      posix_error(rc, "posix_memalign error");
+    memset(r, 0, sizeof(reader_t));
+    r->used = 1;
+    r->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&readers, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  if ((rc = pthread_setspecific(key, r)) != 0)
+    posix_error(rc, "pthread_setspecific error");
+  return r;
+}
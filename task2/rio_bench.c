@@ -0,0 +1,103 @@
+/*
+ * rio_bench - Per-line cost of the rio line readers.
+ *
+ * Feeds the same request lines through the old byte-at-a-time reader,
+ * the memchr-based rio_readlineb and the in-place rio_readlinep, all
+ * reading the lines from a temporary file.
+ */
+#include "csapp.h"
+
+#define NLINES 1000000 /* Lines in the input file */
+#define ROUNDS 5       /* Passes over the file; the best one counts */
+
+/* The previous rio_readlineb: one rio_readnb call per character */
+ssize_t readline_bytewise(rio_t *rp, void *usrbuf, size_t maxlen) {
+  int n, rc;
+  char c, *bufp = usrbuf;
+
+  for (n = 1; n < maxlen; n++) {
+    if ((rc = rio_readnb(rp, &c, 1)) == 1) {
+      *bufp++ = c;
+      if (c == '\n') {
+        n++;
+        break;
+      }
+    } else if (rc == 0) {
+      if (n == 1)
+        return 0;
+      else
+        break;
+    } else
+      return -1;
+  }
+  *bufp = 0;
+  return n - 1;
+}
+
+/* Read every line of fd with reader mode; returns the best ns per line */
+double run(int fd, int mode) {
+  char buf[MAXLINE], *line;
+  struct timespec start, end;
+  double ns, best = 0;
+  long lines, bytes;
+  ssize_t n;
+  rio_t rio;
+
+  for (int r = 0; r < ROUNDS; r++) {
+    lseek(fd, 0, SEEK_SET);
+    Rio_readinitb(&rio, fd);
+    lines = bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+      if (mode == 0)
+        n = readline_bytewise(&rio, buf, MAXLINE);
+      else if (mode == 1)
+        n = Rio_readlineb(&rio, buf, MAXLINE);
+      else
+        n = Rio_readlinep(&rio, &line);
+      if (n <= 0)
+        break;
+      lines++;
+      bytes += n;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (lines != NLINES)
+      app_error("short read");
+    ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+         lines;
+    if (r == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  static char *names[] = {"bytewise", "rio_readlineb", "rio_readlinep"};
+  char line[MAXLINE];
+  FILE *fp;
+  int n;
+
+  /* The mix multiclient sends: show, buy and sell orders */
+  fp = tmpfile();
+  for (int i = 0; i < NLINES; i++) {
+    switch (i % 3) {
+    case 0:
+      n = sprintf(line, "show\n");
+      break;
+    case 1:
+      n = sprintf(line, "buy %d %d\n", i % 10 + 1, i % 10);
+      break;
+    default:
+      n = sprintf(line, "sell %d %d\n", i % 10 + 1, i % 10);
+      break;
+    }
+    fwrite(line, 1, n, fp);
+  }
+  fflush(fp);
+
+  printf("%d lines, best of %d passes\n", NLINES, ROUNDS);
+  for (int mode = 0; mode < 3; mode++)
+    printf("%-14s %8.2f ns/line\n", names[mode], run(fileno(fp), mode));
+  Fclose(fp);
+  exit(0);
+}
@@ -0,0 +1,142 @@
+/*
+ * stock_bench - Trade throughput of packed versus cache-line padded items,
+ * and of padded items under contention.
+ *
+ * In the first table every worker buys and sells its own stock with the
+ * compare-and-swap loop of stockserver.c, so workers never contend for the
+ * same item. With the old packed layout neighbouring items share cache
+ * lines anyway; with the padded one each state word owns its line.
+ *
+ * In the second every worker trades the padded items of a hot set instead,
+ * one stock or HOT_SET of them in turn, as clients piling on a popular
+ * stock do. It gives the total throughput for each number of workers,
+ * with their own stocks for comparison, and the failed compare-and-swaps
+ * per trade on the single hot stock.
+ *
+ * usage: stock_bench [max_workers]
+ */
+#include "csapp.h"
+
+#define CACHELINE 64       /* Bytes per cache line */
+#define TRADES 2000000     /* Buy/sell pairs per worker */
+#define MAXWORKERS 64      /* Upper bound on max_workers */
+#define HOT_SET 4          /* Stocks of the larger hot set; a power of two */
+
+#define STATE(version, left) ((uint64_t)(version) << 32 | (uint32_t)(left))
+#define STATE_LEFT(state) ((int)(uint32_t)(state))
+#define STATE_VERSION(state) ((uint32_t)((state) >> 32))
+
+/* The item before padding: one malloc'd-size record after the other */
+typedef struct {
+  int ID;
+  uint64_t state;
+  int price;
+} packed_item;
+
+/* The item of stockserver.c */
+typedef struct {
+  int ID;
+  int price;
+  uint64_t state __attribute__((aligned(CACHELINE)));
+} padded_item;
+
+static packed_item packed[MAXWORKERS];
+static padded_item padded[MAXWORKERS];
+static int use_padded; /* Layout the current run trades on */
+static int hot;        /* Padded stocks every worker trades; 0 for its own */
+static long retries[MAXWORKERS]; /* Failed compare-and-swaps per worker */
+
+/*
+ * Add delta to the stocks left in *state as stockserver.c trades do;
+ * returns the compare-and-swaps another worker made fail
+ */
+static int trade(uint64_t *state, int delta) {
+  uint64_t old = __atomic_load_n(state, __ATOMIC_RELAXED), new;
+  int failed = 0;
+
+  while (1) {
+    new = STATE(STATE_VERSION(old) + 1, STATE_LEFT(old) + delta);
+    if (__atomic_compare_exchange_n(state, &old, new, 1, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED))
+      return failed;
+    failed++;
+  }
+}
+
+/*
+ * Worker: trade TRADES times each way on its own stock, or else on the
+ * hot stocks in turn, starting at the one its number picks
+ */
+void *worker(void *vargp) {
+  long id = (long)vargp, failed = 0;
+  uint64_t *state = use_padded ? &padded[id].state : &packed[id].state;
+
+  for (int i = 0; i < TRADES; i++) {
+    if (hot)
+      state = &padded[(id + i) & (hot - 1)].state;
+    failed += trade(state, -1);
+    failed += trade(state, 1);
+  }
+  retries[id] = failed;
+  return NULL;
+}
+
+/* Run n workers on the current layout and stocks; returns ns per trade */
+double run(int n) {
+  pthread_t tid[MAXWORKERS];
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < n; i++)
+    Pthread_create(&tid[i], NULL, worker, (void *)i);
+  for (int i = 0; i < n; i++)
+    Pthread_join(tid[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+         (2.0 * TRADES * n);
+}
+
+/* Return the failed compare-and-swaps per trade of the last run of n */
+double failed_per_trade(int n) {
+  long sum = 0;
+
+  for (int i = 0; i < n; i++)
+    sum += retries[i];
+  return sum / (2.0 * TRADES * n);
+}
+
+int main(int argc, char **argv) {
+  int max = argc > 1 ? atoi(argv[1]) : 8;
+  int sets[] = {0, HOT_SET, 1}; /* own stock, hot set, one hot stock */
+  double ns[2], mops[3], failed;
+
+  if (max < 1 || max > MAXWORKERS) {
+    fprintf(stderr, "usage: %s [max_workers <= %d]\n", argv[0], MAXWORKERS);
+    exit(0);
+  }
+  printf("%ld online cores, %d trades per worker\n",
+         sysconf(_SC_NPROCESSORS_ONLN), 2 * TRADES);
+  printf("%7s %14s %14s\n", "workers", "packed ns/op", "padded ns/op");
+  for (int n = 1; n <= max; n *= 2) {
+    for (use_padded = 0; use_padded < 2; use_padded++)
+      ns[use_padded] = run(n);
+    printf("%7d %14.2f %14.2f\n", n, ns[0], ns[1]);
+  }
+
+  /* the same workers, all on the padded stocks of a hot set */
+  use_padded = 1;
+  printf("\ncontended padded items, hot set of %d, total Mtrades/s\n",
+         HOT_SET);
+  printf("%7s %10s %10s %10s %14s\n", "workers", "own stock", "hot set",
+         "one stock", "failed CAS/op");
+  for (int n = 1; n <= max; n *= 2) {
+    for (int k = 0; k < 3; k++) {
+      hot = sets[k];
+      mops[k] = 1e3 / run(n);
+    }
+    failed = failed_per_trade(n); /* of the one-stock run, the last */
+    printf("%7d %10.1f %10.1f %10.1f %14.3f\n", n, mops[0], mops[1], mops[2],
+           failed);
+  }
+  exit(0);
+}
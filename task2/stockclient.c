@@ -3,6 +3,10 @@
  */
 /* $begin echoclientmain */
 #include "csapp.h"
+#include "stockproto.h"
+
+ssize_t read_reply(rio_t *rp, char *buf,
+                   FILE *out); /* Read one framed reply */
 
 int main(int argc, char **argv) {
   int clientfd;
@@ -22,11 +26,16 @@ int main(int argc, char **argv) {
   clientfd = Open_clientfd(host, port);
   Rio_readinitb(&rio, clientfd);
 
+  // Ask for framed replies so only the payload crosses the wire
+  sprintf(buf, "%s\n", PROTO_FRAMED);
+  Rio_writen(clientfd, buf, strlen(buf));
+  read_reply(&rio, buf, NULL);
+
   // Communicate with the server until EOF
   while (Fgets(buf, MAXLINE, stdin) != NULL) {
     Rio_writen(clientfd, buf, strlen(buf));
-    Rio_readnb(&rio, buf, MAXLINE);
-    Fputs(buf, stdout);
+    if (read_reply(&rio, buf, stdout) < 0)
+      break;
 
     // 서버로부터 "exit" 메시지를 받으면 종료
     if (!strcmp(buf, "exit\n")) {
@@ -40,3 +49,28 @@ int main(int argc, char **argv) {
   exit(0);
 }
 /* $end echoclientmain */
+
+/*
+ * read_reply - Read one framed reply in pieces of up to MAXLINE-1 bytes
+ * through buf, NUL-terminating each and writing it to out unless out is
+ * NULL, so a show of any size streams through. buf is left holding the
+ * last piece. Returns the payload size, which may be 0, or -1 on EOF.
+ */
+ssize_t read_reply(rio_t *rp, char *buf, FILE *out) {
+  char hdr[PROTO_FRAMEHDR];
+  size_t len, left, n;
+
+  if (Rio_readlineb(rp, hdr, PROTO_FRAMEHDR) == 0)
+    return -1;
+  len = strtoul(hdr, NULL, 10);
+  buf[0] = '\0';
+  for (left = len; left > 0; left -= n) {
+    n = left < MAXLINE - 1 ? left : MAXLINE - 1;
+    if (Rio_readnb(rp, buf, n) != n)
+      return -1;
+    buf[n] = '\0';
+    if (out != NULL)
+      Fputs(buf, out);
+  }
+  return len;
+}
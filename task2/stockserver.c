@@ -1,316 +1,1985 @@
+#include <poll.h>
+#include <sched.h>
+#include <sys/resource.h>
 #include "csapp.h"
-#define NTHREADS 4 /* The number of threads in the worker thread pool */
+#include "stockproto.h"
+#include "journal.h"
+#include "stockindex.h"
+#include "rcu.h"
+#include "mpmc.h"
+#include "wsdeque.h"
+#include "affinity.h"
+#include "stop.h"
+#include "handoff.h"
+#define NTHREADS 4 /* Workers the pool keeps even when they are idle */
+#define MAXTHREADS 128 /* Workers the pool may grow to */
 #define SBUFSIZE 16 /* The size of buffer shared by the master thread & worker threads */
-#define STOCK_NUM 10 /* The number of stock IDs in the stock server */
+#define IDLE_MS 5000 /* Idle time after which a worker above the minimum exits */
+#define MAXEVENTS 1024 /* Ready descriptors the I/O thread takes per wait */
 #define max(a, b) ((a > b) ? a : b) /* Macro for comparison */
+#define min(a, b) ((a < b) ? a : b) /* Macro for comparison */
+#define CACHELINE 64 /* Bytes per cache line */
+#define BATCH_IOV 64 /* Replies of a pipelined batch sent by one writev */
+#define BATCH_BUF (4 * MAXLINE) /* Bytes a batch may copy before it flushes */
+#define SHOW_LINE 37 /* Longest "id left price\n" show line and its NUL */
+#define SNAP_PASSES 8 /* Collections a rendering takes before it holds trades */
+#define HOLD_RENDER 1 /* trades_held bit of a rendering */
+#define HOLD_HANDOFF 2 /* trades_held bit of a handoff, never cleared */
+#define STATS_LINE 96 /* Longest line of a stats reply */
+#define DRAIN_TICK_MS 10 /* How often a stopping server looks at the workers */
+#define DRAIN_FORCE_MS 1000 /* Wait for workers after their clients are cut */
 
+/*
+ * The worker pool. A worker serves one connection at a time, so the master
+ * adds one whenever more connections wait in sbuf than workers are idle,
+ * and a worker idle for IDLE_MS leaves while the pool is above min.
+ */
 typedef struct {
-  int *buf;    /* Buffer array */
-  int n;       /* Maximum number of slots */
-  int front;   /* buf[(front+1)%n] is the first item */
-  int rear;    /* buf[rear%n] is the last item */
-  sem_t mutex; /* Protects accesses to buf */
-  sem_t slots; /* Counts available slots */
-  sem_t items; /* Counts available items */
-} sbuf_t;
+  int min;      /* Workers kept however idle */
+  int max;      /* Workers the pool may grow to */
+  int nthreads; /* Workers alive */
+  int busy;     /* Workers serving a connection; changed atomically */
+  int inflight; /* Connections or tasks handed out and not done; atomic */
+  sem_t mutex;  /* Protects nthreads */
+} workers_t;
 
+/*
+ * A worker of the request mode. Its tasks never wait on a client, so the
+ * pool is fixed at min. The I/O thread deals tasks round-robin onto the
+ * bottom of each worker's deque, and is thus the one producer of them
+ * all; a worker takes from the top of its own, oldest task first, and
+ * once that is empty steals from the top of the others'. The counters are
+ * only written by the worker itself.
+ */
 typedef struct {
-  int ID;         /* Stock ID */
-  int left_stock; /* The number of stocks left in the market */
-  int price;      /* The price of this stock */
-  int read_cnt;   /* The number of clients reading this item */
-  sem_t mutex;    /* Semaphore for safe writing */
+  wsdeque_t tasks;      /* Tasks dealt to the worker */
+  unsigned long served; /* Tasks it answered */
+  unsigned long stolen; /* Of them, tasks taken from another deque */
+} stealer_t;
+
+/*
+ * A connection of the request mode. The I/O thread reads into rio while
+ * the connection is watched; a worker answers from it while it is a task.
+ * EPOLLONESHOT keeps the two from ever holding it at once. Replies the
+ * journal holds back wait in out, which the I/O thread writes once they
+ * may go.
+ */
+typedef struct {
+  rio_t rio;   /* Bytes read but not answered yet */
+  int framed;  /* Replies are length-framed */
+  int padded;  /* Replies are NUL-padded to MAXLINE */
+  int greeted; /* The first byte, which selects the protocol, was seen */
+  int binary;  /* Speaks the binary protocol of stockproto.h */
+  int eof;     /* The client closed its end */
+  int closing; /* Closed once out is written */
+  char *out;   /* Replies held back, or NULL */
+  size_t outlen;     /* Bytes in out */
+  size_t outsent;    /* Of them, bytes written */
+  size_t outcap;     /* Bytes allocated for out */
+  unsigned long seq; /* Journal record the replies in out wait for */
+} conn_t;
+
+typedef struct {
+  int fd;                        /* Client the replies go to */
+  int framed;                    /* Replies are length-framed */
+  int padded;                    /* Replies are NUL-padded to MAXLINE */
+  struct iovec iov[BATCH_IOV];   /* Pending reply segments */
+  int iovcnt;                    /* Number of pending segments */
+  char buf[BATCH_BUF];           /* Copies of the pending replies */
+  size_t used;                   /* Bytes of buf in use */
+  unsigned long seq;             /* Journal record of its last trade */
+  conn_t *conn;                  /* Request-mode connection, or NULL */
+} batch_t;
+
+/*
+ * The stocks left and the number of trades that led there share one word,
+ * so a trade swaps both with a single compare-and-swap and journal records
+ * of one stock can be put back in order by their trade count.
+ */
+#define STATE(version, left) ((uint64_t)(version) << 32 | (uint32_t)(left))
+#define STATE_LEFT(state) ((int)(uint32_t)(state))
+#define STATE_VERSION(state) ((uint32_t)((state) >> 32))
+
+/*
+ * Items live side by side in the items array. Each takes two cache lines:
+ * one for the fields that never change and one for the state trades
+ * swap, so a trade neither invalidates the ID and price other workers
+ * read nor false-shares with the neighbouring stock.
+ */
+typedef struct {
+  int ID;    /* Stock ID */
+  int price; /* The price of this stock */
+  uint64_t state __attribute__((aligned(CACHELINE)));
+             /* STATE(trades, stocks left in the market) */
 } item;
 
+/* Pre-rendered show replies */
+typedef struct {
+  unsigned long version; /* Table version the rendering shows */
+  char *text;            /* Text reply: "id left price" per stock */
+  size_t len;            /* Length of text */
+  bin_stock *recs;       /* Binary reply records in network order */
+  int count;             /* Number of records */
+  int cap;               /* Stocks text and recs have room for */
+} snapshot_t;
+
+/*
+ * Nodes are never changed once readers can reach them: an update copies
+ * the nodes it changes, and gen tells the copies it already made.
+ */
 typedef struct node {
   item *stock;        /* The stock */
   struct node *left;  /* The left subtree of this node */
   struct node *right; /* The right subtree of this node */
   int height;         /* Height of the subtree */
+  int size;           /* Number of stocks in the subtree */
+  unsigned gen;       /* Update that made the node */
 } node;
 
+/*
+ * One version of the stock universe. Readers use the published one inside
+ * an RCU read section; list and delist build the next beside it.
+ */
+typedef struct {
+  node *tree;        /* AVL tree of the stocks by ID */
+  int count;         /* Number of stocks */
+  item **order;      /* The stocks in the order they were listed */
+  item **by_price;   /* The stocks, highest price first */
+  stock_index index; /* ID lookups of trades, unless a tree kind */
+} universe_t;
+
 static void init_check_order();  /* initialize mutex */
 void check_order(int connfd); /* client */
+int handle_line(batch_t *b, char *line); /* answer one text request */
+int handle_binary(batch_t *b, bin_req *req); /* answer one binary request */
+void serve_requests(int listenfd); /* I/O loop of the request mode */
+static void read_requests(int fd); /* read and queue a client's requests */
+static void watch_conn(int fd);    /* hand a connection to the I/O thread */
+static int serve_events(int timeout); /* one round of the I/O thread */
+static void park_conn(int fd);     /* have the I/O thread write its replies */
+static void take_parked(void);     /* take the connections workers parked */
+static void release_conns(void);   /* write the replies a commit let go */
+static void write_replies(int fd); /* write what the socket takes of them */
+static void finish_conn(int fd);   /* close a connection or watch it again */
+void serve_task(int fd);           /* answer a client's queued requests */
+void send_reply(batch_t *b, char *buf,
+                size_t len);  /* queue one reply in the client's format */
+void flush_replies(batch_t *b); /* write the queued replies at once */
+void check_binary(batch_t *b, rio_t *rio); /* binary-protocol client */
+int read_stock(item *s);          /* read the stocks left of an item */
+static void init_snapshot(void);  /* allocate the show renderings */
+char *show_text(size_t *len);     /* copy the cached show reply */
+bin_stock *show_binary(int *count); /* copy the cached show records */
+bin_stock *query_stocks(int op, int a, int b,
+                        int *count); /* collect a range or a top list */
+char *render_stocks(bin_stock *rec, int n,
+                    size_t *len); /* render records as a show reply */
+static universe_t *make_universe(node *tree, item **order,
+                                 int count); /* index a new version */
+static void publish(universe_t *next); /* replace the universe */
+int list_stock(int id, int left, int price); /* add a stock at runtime */
+int delist_stock(int id);                    /* remove a stock at runtime */
+int buy_stock(int id, int stock,
+              unsigned long *seq); /* buy shares if enough are left */
+int sell_stock(int id, int stock,
+               unsigned long *seq); /* sell shares back to the market */
+static int enter_trade(void);      /* read section once trades may go on */
+static void hold_trades(int why);  /* keep trades away from the table */
+static void release_trades(int why); /* let them go on */
+static int handed_off(void);       /* a successor has the stocks */
+static bin_stock *cutover(int *count,
+                          unsigned **version); /* stop trading for good */
+void save_stocks(void);            /* checkpoint the table to stock.txt */
+void apply_record(int id, int left,
+                  unsigned version); /* replay one journal record */
 void *thread(void *vargs);    /* thread function */
-
-void sbuf_init(sbuf_t *sp, int n);      /* Initialize shared buffer */
-void sbuf_deinit(sbuf_t *sp);           /* Deinitialize shared buffer */
-void sbuf_insert(sbuf_t *sp, int item); /* Insert item into shared buffer */
-int sbuf_remove(sbuf_t *sp);            /* remove item from shared buffer */
+void grow_workers(void);      /* add a worker if connections are waiting */
+void *steal_worker(void *vargp); /* worker of the request mode */
+static int take_task(int self, int *fd); /* own task first, else steal one */
+static void deal_task(int fd);   /* hand a task to the next worker */
+char *render_stats(size_t *len); /* describe the load of the workers */
+static int accept_conn(int listenfd); /* next client, or -1 once stopping */
+static void stop_server(void);   /* drain, checkpoint and exit */
+static int wait_drained(int ms); /* wait until the workers are done */
+static void free_stocks(void);   /* free the universe and its stocks */
+static bin_stock *read_stocks(int *count,
+                              unsigned **version); /* parse stock.txt */
+static bin_stock *copy_stocks(int *count,
+                              unsigned **version); /* copy the stocks */
 
 node *left_rotate(node *x);  /* Rotate the tree to the left */
 node *right_rotate(node *y); /* Rotate the tree to the right */
 int get_balance(node *n);    /* Check the balance of the tree */
 int height(node *n);         /* Get the height of the tree */
+int tree_size(node *n);      /* Get the number of stocks in the tree */
+void update_node(node *n);   /* Recompute height and size from children */
 
 node *insert_stock(node *tree, int id, int left_stock,
                    int price);         /* Insert the node into the tree */
-void delete_stock(node *tree, int id); /* Delete the node from the tree */
+node *delete_stock(node *tree, int id); /* Delete the node from the tree */
+static node *fresh(node *n);   /* Make a node safe for the update to change */
+static void discard(node *n);  /* Free a node the update took out */
+static void free_tree(node *n); /* Free every node of a tree */
+static node *rebalance(node *n); /* Restore the AVL balance at a node */
+static item *new_item(int id, int left_stock, int price); /* Make a stock */
 item *query_stock(node *tree, int id); /* Find a specific node from the tree */
+item *find_stock(int id); /* Find a stock through the index or the tree */
+int count_below(node *tree, long id); /* Count the stocks under an ID */
+int range_stocks(node *tree, int lo, int hi,
+                 bin_stock *rec); /* Collect the stocks of lo..hi */
 
-sbuf_t sbuf;             /* shared buffer */
+static mpmc_t sbuf;      /* shared buffer */
+static workers_t workers; /* the worker pool */
+static int per_request;   /* workers take requests instead of connections */
+static stealer_t **stealers; /* request-mode workers, by number */
+static int nstealers;     /* request-mode workers */
+static int deque_slots;   /* tasks per request-mode deque */
+static pthread_barrier_t started; /* passed once every deque exists */
+static mpmc_lot idle;     /* request-mode workers with nothing to take */
+static cpu_list worker_cpus; /* cores the workers are spread over */
+static cpu_list io_cpus;  /* cores of the accept or I/O thread */
+static cpu_list main_cpus; /* cores main ran on before it took io_cpus */
+static int nstarted;      /* workers numbered so far, for their core */
+static conn_t **conns;    /* request-mode connections by descriptor */
+static int nconns;        /* slots of conns */
+static int io_epfd;       /* epoll instance of the I/O thread */
+static int io_listenfd;   /* listener of the I/O thread */
+static int io_stopped;    /* the I/O thread no longer accepts or reads */
+static int parkfd[2];     /* pipe of the connections workers park */
+static int commitfd;      /* readable after each journal commit */
+static int *parked;       /* connections whose replies wait for a commit */
+static int nparked;       /* entries of parked */
+static int parkcap;       /* entries allocated for parked */
+static int stopfd;        /* readable once SIGINT or SIGTERM arrived */
+static int drain_ms = DRAIN_MS; /* time the workers get to finish */
+static char *held;        /* connection-mode clients by descriptor */
+static char *upgrade_path; /* Unix socket of hot upgrades, if any */
+static pthread_once_t once = PTHREAD_ONCE_INIT; /* runs init_check_order */
 static sem_t mutex;      /* semaphore for reading */
-node *stock_tree = NULL; /* The stock tree */
-item *order[STOCK_NUM] = {
-    NULL,
-}; /* The array to preserve the stock number */
+static universe_t *universe; /* The stocks readers see */
+static sem_t admin_mutex;    /* Serializes list and delist */
+static sem_t save_mutex;     /* Serializes checkpoints */
+static unsigned tree_gen;    /* Update the tree is going through */
+static int index_choice = INDEX_AUTO; /* Index kind asked for with -i */
+static item *items;      /* The stocks of stock.txt in file order, aligned */
+static int nitems;       /* Slots of items in use */
+static int stock_cap;    /* Slots of items allocated */
+static sem_t snap_mutex; /* Serializes renderers of snap */
+static unsigned snap_seq
+    __attribute__((aligned(CACHELINE))); /* Odd while snap is rewritten */
+static snapshot_t snap;   /* Latest rendering of the show reply */
+static snapshot_t back;   /* Buffers the next rendering is made in */
+static uint64_t *collect; /* States of the rendering being collected */
+static unsigned long table_version
+    __attribute__((aligned(CACHELINE))) = 1; /* Bumped by every trade */
+static int trades_held
+    __attribute__((aligned(CACHELINE))); /* HOLD_ bits of who holds trades */
 
 int main(int argc, char **argv) {
   int listenfd, connfd;
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr;
   pthread_t tid;
+  struct rlimit lim;
 
-  char status[MAXLINE], *stateptr;
-  int id, stock, price, n;
-  FILE *fp;
+  int rc, opt, s, nfds = 0, count, taken;
+  unsigned *version;
+  int fds[HANDOFF_MAXFDS];
+  bin_stock *rec = NULL;
+  struct timespec start, end;
+  node *tree = NULL;
+  item **order;
+  int commit_ms = JOURNAL_COMMIT_MS, checkpoint_s = JOURNAL_CHECKPOINT_S;
+  int dirty_max = JOURNAL_DIRTY_MAX, slots = SBUFSIZE;
+
+  /* size the worker pool; set how often the journal is committed and
+   * checkpointed */
+  workers.min = NTHREADS;
+  workers.max = MAXTHREADS;
+  while ((opt = getopt(argc, argv, "m:t:T:q:a:A:i:j:c:d:g:u:")) != -1) {
+    if (opt == 'm' && (!strcmp(optarg, "conn") || !strcmp(optarg, "request"))) {
+      per_request = !strcmp(optarg, "request");
+    } else if (opt == 't' && (workers.min = atoi(optarg)) > 0) {
+      /* workers kept while idle */
+    } else if (opt == 'T' && (workers.max = atoi(optarg)) > 0) {
+      /* workers under the heaviest load */
+    } else if (opt == 'q' && (slots = atoi(optarg)) > 0) {
+      /* connections that may wait, or tasks per worker deque */
+    } else if (opt == 'a' && affinity_parse(optarg, &worker_cpus)) {
+      /* one worker per core of the list, round it if there are more */
+    } else if (opt == 'A' && affinity_parse(optarg, &io_cpus)) {
+      /* irq:<nic> puts accepts and reads where the packets arrive */
+    } else if (opt == 'i' && (index_choice = index_kind(optarg)) != -2) {
+      /* how trades find their stock */
+    } else if (opt == 'j' && (commit_ms = atoi(optarg)) >= 0) {
+      /* 0 commits as soon as the last commit is done */
+    } else if (opt == 'c' && (checkpoint_s = atoi(optarg)) >= 0) {
+      /* 0 leaves checkpoints to the dirty count */
+    } else if (opt == 'd' && (dirty_max = atoi(optarg)) >= 0) {
+      /* 0 leaves checkpoints to the timer */
+    } else if (opt == 'g' && (drain_ms = atoi(optarg)) >= 0) {
+      /* grace the workers get once SIGINT or SIGTERM arrives */
+    } else if (opt == 'u') {
+      upgrade_path = optarg; /* take over from the server there, if any */
+    } else {
+      optind = argc; /* force the usage message */
+      break;
+    }
+  }
 
   /* When we execute stockserver, we need another argument named port. */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  if (argc - optind != 1 || workers.max < workers.min) {
+    fprintf(stderr,
+            "usage: %s [-m conn|request] [-t min_threads] [-T max_threads] "
+            "[-q queue_slots] [-a cpus|irq:name] [-A cpus|irq:name] "
+            "[-i auto|tree|hash|direct] [-j commit_ms] [-c checkpoint_s] "
+            "[-d dirty_max] [-g drain_ms] [-u upgrade_sock] <port>\n",
+            argv[0]);
     exit(0);
   }
 
+  /* before any thread, so that all of them leave the signals to stop_init */
+  stopfd = stop_init();
+  affinity_get(&main_cpus);
+
+  /* descriptors index conns and held, so they cover every one the process
+   * may get */
+  if (getrlimit(RLIMIT_NOFILE, &lim) < 0)
+    unix_error("getrlimit error");
+  nconns = lim.rlim_cur == RLIM_INFINITY ? 1 << 20 : (int)lim.rlim_cur;
+
+  /* A predecessor hands over its listener and stocks as soon as it has
+   * stopped trading; the port stays bound meanwhile */
+  if (upgrade_path != NULL && (s = handoff_connect(upgrade_path)) >= 0) {
+    printf("taking over from the server on %s\n", upgrade_path);
+    fflush(stdout);
+    rec = handoff_recv(s, fds, &nfds, &count, &version);
+  }
+  taken = rec != NULL;
+  for (int i = 1; i < nfds; i++)
+    Close(fds[i]); /* one listener is all the workers need */
+
   /* Open a file descriptor(port) and wait for request */
-  listenfd = Open_listenfd(argv[1]);
+  listenfd = nfds > 0 ? fds[0] : Open_listenfd(argv[optind]);
 
   /* initialize the shared buffer */
-  sbuf_init(&sbuf, SBUFSIZE);
+  mpmc_init(&sbuf, slots);
 
-  /* Create worker threads */
-  for (int i = 0; i < NTHREADS; i++) {
-    Pthread_create(&tid, NULL, thread, NULL);
+  /* Create the minimum of worker threads; more come with the load, except
+   * in the request mode, where each worker makes its deque of slots tasks
+   * and the dealing waits until all of them are ready */
+  Sem_init(&workers.mutex, 0, 1);
+  workers.nthreads = workers.min;
+  if (per_request) {
+    nstealers = workers.min;
+    deque_slots = slots;
+    stealers = Calloc(nstealers, sizeof(stealer_t *));
+    if ((rc = pthread_barrier_init(&started, NULL, nstealers + 1)) != 0)
+      posix_error(rc, "pthread_barrier_init error");
+    mpmc_lot_init(&idle);
   }
+  for (int i = 0; i < workers.min; i++) {
+    Pthread_create(&tid, NULL, per_request ? steal_worker : thread,
+                   (void *)(long)i);
+  }
+  if (per_request)
+    pthread_barrier_wait(&started);
 
-  /* open the file with stock data */
-  fp = Fopen("stock.txt", "r");
-  /* read stock table from the file and make the stock tree*/
-  n = 0;
-  while (Fgets(status, MAXLINE, fp) != NULL) {
-    id = atoi(strtok_r(status, " ", &stateptr));
-    stock = atoi(strtok_r(NULL, " ", &stateptr));
-    price = atoi(strtok_r(NULL, " ", &stateptr));
-    stock_tree = insert_stock(stock_tree, id, stock, price);
-    order[n++] = query_stock(stock_tree, id);
-    memset(status, '\0', MAXLINE);
-  }
-  /* close the file */
-  Fclose(fp);
+  Sem_init(&admin_mutex, 0, 1);
+  Sem_init(&save_mutex, 0, 1);
 
-  /* Manage connection */
-  while (1) {
-    clientlen = sizeof(struct sockaddr_storage);
-    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    sbuf_insert(&sbuf, connfd);
+  /* take the stocks of the predecessor, else those of stock.txt */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (!taken)
+    rec = read_stocks(&count, &version);
+  stock_cap = count;
+  rc = posix_memalign((void **)&items, CACHELINE,
+                      max(stock_cap, 1) * sizeof(item));
+  if (rc != 0)
+    posix_error(rc, "posix_memalign error");
+  /* every worker trades on it, so no node of theirs should hold it all */
+  affinity_interleave(items, max(stock_cap, 1) * sizeof(item));
+  /* make the stock tree; a stock checkpointed by an earlier run resumes
+   * its trade count, so no journal record older than the checkpoint wins */
+  for (int i = 0; i < count; i++) {
+    tree = insert_stock(tree, rec[i].id, rec[i].left, rec[i].price);
+    query_stock(tree, rec[i].id)->state = STATE(version[i], rec[i].left);
+  }
+  Free(rec);
+  Free(version);
+
+  /* index the stocks for the lookups of trades */
+  order = Malloc(max(nitems, 1) * sizeof(item *));
+  for (int i = 0; i < nitems; i++)
+    order[i] = &items[i];
+  universe = make_universe(tree, order, nitems);
+
+  /* trades since the last checkpoint are in the journal, unless the stocks
+   * of the predecessor hold them already */
+  if (!taken)
+    journal_replay(apply_record);
+  init_snapshot();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("loaded %d stocks in %.1f ms, %s index\n", nitems,
+         (end.tv_sec - start.tv_sec) * 1e3 +
+             (end.tv_nsec - start.tv_nsec) / 1e6,
+         index_name(universe->index.kind));
+  journal_open(commit_ms, checkpoint_s, dirty_max, save_stocks);
+  if (upgrade_path != NULL)
+    handoff_listen(upgrade_path, &listenfd, 1, cutover);
+
+  /* Manage connection until SIGINT or SIGTERM; the journal threads stay
+   * where they were made */
+  affinity_pin(&io_cpus);
+  held = Calloc(nconns, 1);
+  if (per_request)
+    serve_requests(listenfd);
+  while (!per_request && (connfd = accept_conn(listenfd)) >= 0) {
+    if (connfd < nconns)
+      __atomic_store_n(&held[connfd], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&workers.inflight, 1, __ATOMIC_SEQ_CST);
+    mpmc_push(&sbuf, connfd);
+    grow_workers();
   }
 
-  /* delete the stock tree */
-  while (stock_tree->left != NULL || stock_tree->right != NULL) {
-    if (stock_tree->left != NULL) {
-      delete_stock(stock_tree, stock_tree->left->stock->ID);
-    } else if (stock_tree->right != NULL) {
-      delete_stock(stock_tree, stock_tree->right->stock->ID);
+  /* no new client from here on, unless a successor takes the listener */
+  if (stop_successor() < 0)
+    Close(listenfd);
+  stop_server();
+  return 0;
+}
+
+/* Accept the next client; returns -1 once SIGINT or SIGTERM arrived */
+static int accept_conn(int listenfd) {
+  struct pollfd fds[2] = {{listenfd, POLLIN, 0}, {stopfd, POLLIN, 0}};
+  struct sockaddr_storage clientaddr;
+  socklen_t clientlen;
+
+  while (1) {
+    if (poll(fds, 2, -1) < 0 && errno != EINTR)
+      unix_error("poll error");
+    if (fds[1].revents)
+      return -1;
+    if (fds[0].revents) {
+      clientlen = sizeof(struct sockaddr_storage);
+      return Accept(listenfd, (SA *)&clientaddr, &clientlen);
     }
   }
+}
+
+/*
+ * stop_server - Shut down after SIGINT or SIGTERM, the listener closed,
+ * or for a successor, which has the listener already. Trades are
+ * committed as they come from here on, and the workers get drain_ms to
+ * finish what they were handed. A connection-mode client that is still
+ * connected then has its reading side shut, so its worker reads EOF after
+ * the request it is on, and a request-mode task is simply finished. A
+ * last checkpoint writes stock.txt, and the stocks are freed unless some
+ * worker is stuck in spite of it. A successor has the stocks once the
+ * cutover stopped trading, so the workers only send the replies they
+ * have, and the connection-mode clients are shut at once; stock.txt and
+ * the journal are the successor's, so there is no checkpoint.
+ */
+static void stop_server(void) {
+  int drained, successor = stop_successor() >= 0;
 
+  printf("draining for up to %d ms\n", drain_ms);
+  journal_flush();
+  if (successor) {
+    handoff_finish();
+    for (int fd = 0; !per_request && fd < nconns; fd++)
+      if (__atomic_load_n(&held[fd], __ATOMIC_RELAXED))
+        shutdown(fd, SHUT_RD);
+    drained = wait_drained(drain_ms);
+    printf("stopped%s\n", drained ? "" : " with workers still busy");
+    exit(0);
+  }
+  drained = wait_drained(drain_ms);
+  if (!drained) {
+    for (int fd = 0; !per_request && fd < nconns; fd++)
+      if (__atomic_load_n(&held[fd], __ATOMIC_RELAXED))
+        shutdown(fd, SHUT_RD);
+    drained = wait_drained(DRAIN_FORCE_MS);
+  }
+  save_stocks();
+  if (drained)
+    free_stocks();
+  printf("stopped%s\n", drained ? "" : " with workers still busy");
   exit(0);
 }
 
+/* Wait up to ms for the workers to finish; returns 0 if they did not */
+static int wait_drained(int ms) {
+  long deadline = stop_clock() + ms;
+
+  while (__atomic_load_n(&workers.inflight, __ATOMIC_SEQ_CST) > 0) {
+    if (stop_clock() >= deadline)
+      return 0;
+    if (per_request)
+      serve_events(DRAIN_TICK_MS); /* parked replies go out meanwhile */
+    else
+      usleep(DRAIN_TICK_MS * 1000);
+  }
+  return 1;
+}
+
+/*
+ * free_stocks - Free the universe, its tree and its stocks. Checkpoints
+ * still due find no universe and write nothing; the last reader leaves
+ * before the memory goes. Items outside the items array were allocated
+ * one by one when they were listed.
+ */
+static void free_stocks(void) {
+  universe_t *u;
+
+  P(&save_mutex);
+  u = universe;
+  __atomic_store_n(&universe, NULL, __ATOMIC_RELEASE);
+  V(&save_mutex);
+  rcu_synchronize();
+  free_tree(u->tree);
+  for (int i = 0; i < u->count; i++)
+    if (u->order[i] < items || u->order[i] >= items + stock_cap)
+      Free(u->order[i]);
+  Free(items);
+  Free(u->order);
+  Free(u->by_price);
+  index_free(&u->index, Free);
+  Free(u);
+}
+
 /* initialize mutex */
-static void init_check_order(void) { Sem_init(&mutex, 0, 1); }
+static void init_check_order(void) {
+  Sem_init(&mutex, 0, 1);
+  Sem_init(&snap_mutex, 0, 1);
+}
 
 /* client */
 void check_order(int connfd) {
-  int n, id, stock;
-  char buf[MAXLINE],
-      status[MAXLINE] =
-          {
-              "\0",
-          },
-      result[MAXLINE] =
-          {
-              "\0",
-          },
-      *comp[3] =
-          {
-              "\0",
-          },
-      *stateptr;
-  FILE *fp;
+  int n;
+  char buf[MAXLINE], *line;
+  int binary; /* the client speaks the binary protocol */
   rio_t rio;
-  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  batch_t batch; /* replies not written yet */
 
   /* Execute init_echo_cnt once  */
   Pthread_once(&once, init_check_order);
 
   /* Initialize robust I/O*/
   Rio_readinitb(&rio, connfd);
+  batch.fd = connfd;
+  batch.framed = 0;
+  batch.padded = 1; /* until the client asks for framing */
+  batch.iovcnt = 0;
+  batch.used = 0;
+  batch.seq = 0;
+  batch.conn = NULL; /* the worker waits for the journal itself */
+
+  /* The first byte tells a binary client from a text one */
+  binary = recv(connfd, buf, 1, MSG_PEEK) == 1 &&
+           (unsigned char)buf[0] == PROTO_BINARY;
+  if (binary) {
+    Rio_readnb(&rio, buf, 1);
+    batch.padded = 0;
+    check_binary(&batch, &rio);
+  }
 
   /* Continuously read a line from the client */
-  while ((n = Rio_readlineb(&rio, buf, MAXLINE) != 0)) {
+  while (!binary && (n = Rio_readlinep(&rio, &line)) != 0) {
+    /*
+     * A pipelining client may have sent more lines along with this one.
+     * Their replies are gathered and leave together before the next
+     * read that could block.
+     */
 
     printf("server received %d bytes\n", n);
 
-    /* Parse the line from the client */
-    comp[0] = strtok_r(buf, " \n", &stateptr);
-    for (int x = 1; x < 3; x++) {
-      comp[x] = strtok_r(NULL, " \n", &stateptr);
+    /* The line is parsed where it lies unless it has no newline to spare */
+    if (line[n - 1] == '\n') {
+      line[n - 1] = '\0';
+    } else {
+      n = min(n, MAXLINE - 1);
+      memcpy(buf, line, n);
+      buf[n] = '\0';
+      line = buf;
     }
+    if (!handle_line(&batch, line))
+      break;
+    if (!memchr(rio.rio_bufptr, '\n', rio.rio_cnt))
+      flush_replies(&batch);
+  }
+  flush_replies(&batch);
+}
 
-    /* Do the appropriate action based on the parsed line */
-    if (!strcmp(comp[0], "show")) {
-      /* show the stock data */
-      memset(result, '\0', MAXLINE);
-      for (int i = 0; i < STOCK_NUM; i++) {
-        if (order[i]) {                /* if the stock exists */
-          P(&mutex);                   /* get the lock for reading */
-          order[i]->read_cnt++;        /* increase the read count */
-          if (order[i]->read_cnt == 1) /* after it is properly increased */
-            P(&order[i]->mutex);       /* get the lock for item */
-          V(&mutex);                   /* free the lock for reading*/
-          sprintf(status, "%d %d %d\n", order[i]->ID, order[i]->left_stock,
-                  order[i]->price);
-          strcat(result, status);
-          P(&mutex);                   /* get the lock for reading */
-          order[i]->read_cnt--;        /* decrease the read count */
-          if (order[i]->read_cnt == 0) /* after it is properly decreased */
-            V(&order[i]->mutex);       /* free the lock for item */
-          V(&mutex);                   /* free the lock for reading */
-        }
+/*
+ * answer one text request line; returns 0 once the client said exit, or
+ * once a successor has the stocks, which leaves the request unanswered
+ */
+int handle_line(batch_t *b, char *line) {
+  int n, id, done;
+  char status[MAXLINE] =
+           {
+               "\0",
+           },
+       *comp[4] =
+           {
+               "\0",
+           },
+       *stateptr, *text;
+  size_t len;
+  bin_stock *rec;
+
+  /* Parse the line from the client */
+  comp[0] = strtok_r(line, " \n", &stateptr);
+  for (int x = 1; x < 4; x++) {
+    comp[x] = strtok_r(NULL, " \n", &stateptr);
+  }
+  if (comp[0] == NULL)
+    return 1;
+  if (handed_off())
+    return 0;
+
+  /* Do the appropriate action based on the parsed line */
+  if (!strcmp(comp[0], "show") && comp[1] != NULL) {
+    /* show lo hi: the stocks with IDs in lo..hi, in ID order */
+    id = atoi(comp[1]);
+    rec = query_stocks(OP_RANGE, id, comp[2] ? atoi(comp[2]) : id, &n);
+    text = render_stocks(rec, n, &len);
+    send_reply(b, text, len);
+  } else if (!strcmp(comp[0], "show")) {
+    /* show the latest rendering of the stock table */
+    text = show_text(&len);
+    send_reply(b, text, len);
+  } else if (!strcmp(comp[0], "top") && comp[1] != NULL && comp[2] != NULL &&
+             (!strcmp(comp[2], "price") || !strcmp(comp[2], "stock"))) {
+    /* top n price|stock: the n best stocks by that key */
+    rec = query_stocks(OP_TOP, atoi(comp[1]),
+                       strcmp(comp[2], "price") ? TOP_STOCK : TOP_PRICE, &n);
+    text = render_stocks(rec, n, &len);
+    send_reply(b, text, len);
+  } else if (!strcmp(comp[0], "top")) {
+    sprintf(status, "[top] fail\n");
+    send_reply(b, status, strlen(status));
+  } else if (!strcmp(comp[0], "buy")) {
+    /* buy id n: take n shares of a stock */
+    if (comp[2] == NULL) {
+      sprintf(status, "[buy] fail\n");
+    } else if ((done = buy_stock(atoi(comp[1]), atoi(comp[2]), &b->seq)) < 0) {
+      return 0;
+    } else if (!done) {
+      sprintf(status, "Not enough left stocks\n");
+    } else {
+      sprintf(status, "[buy] success\n");
+    }
+    send_reply(b, status, strlen(status));
+  } else if (!strcmp(comp[0], "sell")) {
+    /* sell id n: give n shares of a stock back */
+    done = comp[2] != NULL ? sell_stock(atoi(comp[1]), atoi(comp[2]), &b->seq)
+                           : 0;
+    if (done < 0) {
+      return 0;
+    } else if (!done) {
+      sprintf(status, "[sell] fail\n");
+    } else {
+      sprintf(status, "[sell] success\n");
+    }
+    send_reply(b, status, strlen(status));
+  } else if (!strcmp(comp[0], "list")) {
+    /* list id left price: add a stock to the market */
+    done = comp[3] != NULL
+               ? list_stock(atoi(comp[1]), atoi(comp[2]), atoi(comp[3]))
+               : 0;
+    if (done < 0) {
+      return 0;
+    } else if (!done) {
+      sprintf(status, "[list] fail\n");
+    } else {
+      sprintf(status, "[list] success\n");
+    }
+    send_reply(b, status, strlen(status));
+  } else if (!strcmp(comp[0], "delist")) {
+    /* delist id: take a stock off the market */
+    done = comp[1] != NULL ? delist_stock(atoi(comp[1])) : 0;
+    if (done < 0) {
+      return 0;
+    } else if (!done) {
+      sprintf(status, "[delist] fail\n");
+    } else {
+      sprintf(status, "[delist] success\n");
+    }
+    send_reply(b, status, strlen(status));
+  } else if (!strcmp(comp[0], "stats")) {
+    /* stats: how the load spreads over the workers */
+    text = render_stats(&len);
+    send_reply(b, text, len);
+  } else if (!strcmp(comp[0], "exit")) {
+    P(&mutex);
+    // send message to the client
+    sprintf(status, "exit\n");
+    send_reply(b, status, strlen(status));
+    V(&mutex);
+    return 0;
+  } else if (!strcmp(comp[0], PROTO_FRAMED)) {
+    b->framed = 1;
+    b->padded = 0;
+    sprintf(status, "ok\n");
+    send_reply(b, status, strlen(status));
+  }
+  return 1;
+}
+
+/* Serve a binary-protocol client (see stockproto.h) until exit or EOF */
+void check_binary(batch_t *b, rio_t *rio) {
+  bin_req req;
+
+  while (Rio_readnb(rio, &req, sizeof(bin_req)) == sizeof(bin_req)) {
+    if (!handle_binary(b, &req))
+      break;
+    if (rio->rio_cnt < (int)sizeof(bin_req))
+      flush_replies(b);
+  }
+  flush_replies(b);
+}
+
+/*
+ * answer one binary request; returns 0 once it was OP_EXIT, or once a
+ * successor has the stocks, which leaves the request unanswered
+ */
+int handle_binary(batch_t *b, bin_req *req) {
+  bin_reply reply;
+  bin_stock *rec = NULL;
+  int n = 0, done;
+
+  if (handed_off())
+    return 0;
+  memset(&reply, 0, sizeof(bin_reply));
+  reply.op = req->op;
+  switch (req->op) {
+  case OP_SHOW:
+    rec = show_binary(&n);
+    done = 1;
+    break;
+  case OP_RANGE:
+  case OP_TOP:
+    done = req->op == OP_RANGE || ntohl(req->qty) <= TOP_STOCK;
+    if (done) {
+      rec = query_stocks(req->op, ntohl(req->id), ntohl(req->qty), &n);
+      for (int i = 0; i < n; i++) {
+        rec[i].id = htonl(rec[i].id);
+        rec[i].left = htonl(rec[i].left);
+        rec[i].price = htonl(rec[i].price);
+      }
+    }
+    break;
+  case OP_BUY:
+    done = buy_stock(ntohl(req->id), ntohl(req->qty), &b->seq);
+    break;
+  case OP_SELL:
+    done = sell_stock(ntohl(req->id), ntohl(req->qty), &b->seq);
+    break;
+  case OP_EXIT:
+    done = 1;
+    break;
+  default:
+    done = 0;
+    break;
+  }
+  if (done < 0)
+    return 0;
+  reply.status = done ? BIN_OK : BIN_FAIL;
+  reply.count = htonl(n);
+  send_reply(b, (char *)&reply, sizeof(bin_reply));
+  if (n > 0) /* the records follow the header unframed */
+    send_reply(b, (char *)rec, n * sizeof(bin_stock));
+  return req->op != OP_EXIT;
+}
+
+/*
+ * serve_requests - The I/O loop of the request mode. It accepts clients
+ * and reads whatever they send; once a connection holds a whole request,
+ * its descriptor is dealt to a worker as a task, and it is not watched
+ * again until a worker has answered every request buffered. A worker thus
+ * never waits on an idle client, so a few workers can serve any number.
+ * Nor does it wait on the journal: a connection whose replies have to
+ * wait for a commit is parked, and the loop writes them after the commit.
+ * It returns once SIGINT or SIGTERM arrived, leaving the tasks dealt and
+ * the replies parked to the drain.
+ */
+void serve_requests(int listenfd) {
+  struct epoll_event ev;
+
+  conns = Calloc(nconns, sizeof(conn_t *));
+  io_listenfd = listenfd;
+  io_epfd = Epoll_create1(0);
+  if (pipe(parkfd) < 0)
+    unix_error("pipe error");
+  fcntl(parkfd[0], F_SETFL, fcntl(parkfd[0], F_GETFL, 0) | O_NONBLOCK);
+  commitfd = journal_notify();
+  ev.events = EPOLLIN;
+  ev.data.fd = listenfd;
+  Epoll_ctl(io_epfd, EPOLL_CTL_ADD, listenfd, &ev);
+  ev.data.fd = stopfd;
+  Epoll_ctl(io_epfd, EPOLL_CTL_ADD, stopfd, &ev);
+  ev.data.fd = parkfd[0];
+  Epoll_ctl(io_epfd, EPOLL_CTL_ADD, parkfd[0], &ev);
+  ev.data.fd = commitfd;
+  Epoll_ctl(io_epfd, EPOLL_CTL_ADD, commitfd, &ev);
+
+  while (serve_events(-1))
+    ;
+}
+
+/*
+ * serve_events - Handle the events of the I/O thread that arrive within
+ * timeout ms, or wait for the first if it is -1. Returns 0 once SIGINT or
+ * SIGTERM arrived; no client is accepted or read from then on, so the
+ * rounds of a draining server only write the replies parked.
+ */
+static int serve_events(int timeout) {
+  struct epoll_event ev, events[MAXEVENTS];
+  struct sockaddr_storage clientaddr;
+  socklen_t clientlen;
+  int n, fd;
+
+  n = Epoll_wait(io_epfd, events, MAXEVENTS, timeout);
+  for (int i = 0; i < n; i++) {
+    fd = events[i].data.fd;
+    if (fd == stopfd) {
+      /* the tasks dealt so far are still answered */
+      Epoll_ctl(io_epfd, EPOLL_CTL_DEL, stopfd, NULL);
+      Epoll_ctl(io_epfd, EPOLL_CTL_DEL, io_listenfd, NULL);
+      io_stopped = 1;
+    } else if (fd == parkfd[0]) {
+      take_parked();
+    } else if (fd == commitfd) {
+      release_conns();
+    } else if (fd != io_listenfd) {
+      if (conns[fd]->out != NULL)
+        write_replies(fd);
+      else if (!io_stopped)
+        read_requests(fd);
+    } else if (!io_stopped) {
+      clientlen = sizeof(struct sockaddr_storage);
+      fd = Accept(io_listenfd, (SA *)&clientaddr, &clientlen);
+      if (fd >= nconns) {
+        Close(fd);
+        continue;
+      }
+      conns[fd] = Calloc(1, sizeof(conn_t));
+      Rio_readinitb(&conns[fd]->rio, fd);
+      conns[fd]->padded = 1; /* until the client asks for framing */
+      ev.events = EPOLLIN | EPOLLONESHOT;
+      ev.data.fd = fd;
+      Epoll_ctl(io_epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+  }
+  return !io_stopped;
+}
+
+/*
+ * park_conn - Hand the client on fd back to the I/O thread with the
+ * replies held in its out, to be written once the journal has their
+ * trades on disk. The connection counts as in flight until then, so a
+ * draining server writes them too.
+ */
+static void park_conn(int fd) {
+  __atomic_add_fetch(&workers.inflight, 1, __ATOMIC_SEQ_CST);
+  Rio_writen(parkfd[1], &fd, sizeof(int));
+}
+
+/*
+ * take_parked - Empty the pipe of the connections workers parked. Replies
+ * whose trades a commit already took are written at once, the others wait
+ * in parked for the next commit.
+ */
+static void take_parked(void) {
+  int fds[64];
+  ssize_t n;
+
+  while ((n = read(parkfd[0], fds, sizeof(fds))) > 0) {
+    for (int k = 0; k < n / (int)sizeof(int); k++) {
+      if (journal_durable(conns[fds[k]]->seq)) {
+        write_replies(fds[k]);
+        continue;
+      }
+      if (nparked == parkcap) {
+        parkcap = max(64, 2 * parkcap);
+        parked = Realloc(parked, parkcap * sizeof(int));
       }
-      P(&mutex); /* get the lock */
-      Rio_writen(connfd, result, MAXLINE);
-      V(&mutex); /* free the lock */
-    } else if (!strcmp(comp[0], "buy")) {
-      id = atoi(comp[1]);
-      stock = atoi(comp[2]);
-      item *stock_item = query_stock(stock_tree, id);
-      P(&stock_item->mutex);
-      if (stock_item == NULL || stock_item->left_stock < stock) {
-        sprintf(status, "Not enough left stocks\n");
-        Rio_writen(connfd, status, MAXLINE);
-      } else {
-        stock_item->left_stock -= stock;
-        sprintf(status, "[buy] success\n");
-        Rio_writen(connfd, status, MAXLINE);
+      parked[nparked++] = fds[k];
+    }
+  }
+}
+
+/*
+ * release_conns - Empty the commit pipe and write the replies of every
+ * parked connection whose last trade is now on disk
+ */
+static void release_conns(void) {
+  char buf[64];
+  int kept = 0;
+
+  while (read(commitfd, buf, sizeof(buf)) > 0)
+    ;
+  for (int k = 0; k < nparked; k++) {
+    if (!journal_durable(conns[parked[k]]->seq))
+      parked[kept++] = parked[k];
+    else
+      write_replies(parked[k]);
+  }
+  nparked = kept;
+}
+
+/*
+ * write_replies - Write what the socket takes of the replies held for the
+ * client on fd, and watch it for room for the rest. Once every reply is
+ * written, or the client is gone, the connection is done with the task
+ * it was parked by.
+ */
+static void write_replies(int fd) {
+  conn_t *c = conns[fd];
+  struct epoll_event ev;
+  ssize_t n;
+
+  while (c->outsent < c->outlen) {
+    n = send(fd, c->out + c->outsent, c->outlen - c->outsent,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n > 0) {
+      c->outsent += n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      ev.events = EPOLLOUT | EPOLLONESHOT;
+      ev.data.fd = fd;
+      Epoll_ctl(io_epfd, EPOLL_CTL_MOD, fd, &ev);
+      return;
+    } else if (errno != EINTR) {
+      c->closing = 1;
+      break;
+    }
+  }
+  Free(c->out);
+  c->out = NULL;
+  c->outlen = c->outsent = c->outcap = 0;
+  finish_conn(fd);
+  __atomic_sub_fetch(&workers.inflight, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * finish_conn - Close the connection on fd after exit or EOF, or have the
+ * I/O thread watch it for its next requests
+ */
+static void finish_conn(int fd) {
+  conn_t *c = conns[fd];
+
+  if (c->closing) {
+    /* the slot is cleared first: Accept may reuse fd once it is closed */
+    conns[fd] = NULL;
+    Free(c);
+    Close(fd);
+    return;
+  }
+  watch_conn(fd);
+}
+
+/*
+ * read_requests - Read what the client on fd sent behind its unanswered
+ * bytes. A whole request, or the end of the connection, makes it a task;
+ * otherwise the descriptor is watched for the rest.
+ */
+static void read_requests(int fd) {
+  conn_t *c = conns[fd];
+  rio_t *rp = &c->rio;
+  ssize_t n;
+
+  if (rp->rio_bufptr != rp->rio_buf) {
+    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+  }
+  n = recv(fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt,
+           MSG_DONTWAIT);
+  if (n > 0)
+    rp->rio_cnt += n;
+  else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    c->eof = 1;
+
+  /* The first byte tells a binary client from a text one */
+  if (!c->greeted && rp->rio_cnt > 0) {
+    c->greeted = 1;
+    if ((unsigned char)*rp->rio_bufptr == PROTO_BINARY) {
+      c->binary = 1;
+      c->padded = 0;
+      rp->rio_bufptr++;
+      rp->rio_cnt--;
+    }
+  }
+
+  if (c->eof || (c->binary ? rp->rio_cnt >= (int)sizeof(bin_req)
+                           : rp->rio_cnt == RIO_BUFSIZE ||
+                                 memchr(rp->rio_bufptr, '\n', rp->rio_cnt))) {
+    deal_task(fd);
+  } else {
+    watch_conn(fd);
+  }
+}
+
+/* Have the I/O thread watch fd again for its next read */
+static void watch_conn(int fd) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.fd = fd;
+  Epoll_ctl(io_epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*
+ * serve_task - Answer every whole request buffered for the client on fd,
+ * write the replies at once and hand the connection back to the I/O
+ * thread, or close it after exit or EOF. Replies the journal holds back
+ * are left to the I/O thread, which does either once they are written. A
+ * line that fills the buffer without a newline is cut as check_order cuts
+ * it.
+ */
+void serve_task(int fd) {
+  conn_t *c = conns[fd];
+  rio_t *rp = &c->rio;
+  char buf[MAXLINE], *line, *nl;
+  batch_t batch; /* replies not written yet */
+  bin_req req;
+  int n, open = 1;
+
+  Pthread_once(&once, init_check_order);
+  batch.fd = fd;
+  batch.framed = c->framed;
+  batch.padded = c->padded;
+  batch.iovcnt = 0;
+  batch.used = 0;
+  batch.seq = 0;
+  batch.conn = c;
+
+  while (open) {
+    if (c->binary) {
+      if (rp->rio_cnt < (int)sizeof(bin_req))
+        break;
+      memcpy(&req, rp->rio_bufptr, sizeof(bin_req));
+      rp->rio_bufptr += sizeof(bin_req);
+      rp->rio_cnt -= sizeof(bin_req);
+      open = handle_binary(&batch, &req);
+      continue;
+    }
+    nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt);
+    if (nl == NULL && rp->rio_cnt < RIO_BUFSIZE)
+      break;
+    line = rp->rio_bufptr;
+    n = nl != NULL ? nl - line + 1 : rp->rio_cnt;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    printf("server received %d bytes\n", n);
+    if (nl != NULL) {
+      *nl = '\0';
+    } else {
+      n = min(n, MAXLINE - 1);
+      memcpy(buf, line, n);
+      buf[n] = '\0';
+      line = buf;
+    }
+    open = handle_line(&batch, line);
+  }
+  flush_replies(&batch);
+  c->framed = batch.framed;
+  c->padded = batch.padded;
+  c->closing = !open || c->eof;
+  if (c->out != NULL)
+    park_conn(fd);
+  else
+    finish_conn(fd);
+}
+
+/* Return the left stock of s; trades swap it atomically, so no lock */
+int read_stock(item *s) {
+  return STATE_LEFT(__atomic_load_n(&s->state, __ATOMIC_ACQUIRE));
+}
+
+/* Size the show renderings for the stocks loaded */
+static void init_snapshot(void) {
+  snapshot_t *bufs[] = {&snap, &back};
+  int n = max(universe->count, 1);
+
+  for (int i = 0; i < 2; i++) {
+    bufs[i]->text = Malloc(n * SHOW_LINE);
+    bufs[i]->recs = Malloc(n * sizeof(bin_stock));
+    bufs[i]->cap = n;
+  }
+  collect = Malloc(n * sizeof(uint64_t));
+}
+
+/*
+ * refresh_snapshot - Re-render snap unless it already shows the table at
+ * version want or later. Called with snap_mutex held, outside any read
+ * section. The stocks are collected until two passes agree; trade counts
+ * never repeat, so every stock then held its value at one instant between
+ * the passes. A large table under steady trading may not settle that
+ * way, so after SNAP_PASSES the trades are held out for the one pass that
+ * does. The rendering goes to back and is published by swapping the two,
+ * so a reader can only meet a buffer being rewritten after a swap it will
+ * see. Buffers outgrown by a list are retired, as such a reader may still
+ * copy from them.
+ */
+static void refresh_snapshot(unsigned long want) {
+  unsigned long version = __atomic_load_n(&table_version, __ATOMIC_ACQUIRE);
+  universe_t *u;
+  item **order;
+  snapshot_t old;
+  uint64_t again;
+  size_t len = 0;
+  int nitems, same, passes, held = 0;
+
+  if (snap.version >= want)
+    return;
+  while (1) {
+    rcu_read_lock();
+    u = __atomic_load_n(&universe, __ATOMIC_ACQUIRE);
+    order = u->order;
+    nitems = u->count;
+    if (back.cap < nitems) {
+      rcu_retire(back.text);
+      rcu_retire(back.recs);
+      back.text = Malloc(nitems * SHOW_LINE);
+      back.recs = Malloc(nitems * sizeof(bin_stock));
+      back.cap = nitems;
+      collect = Realloc(collect, nitems * sizeof(uint64_t));
+    }
+    for (int i = 0; i < nitems; i++)
+      collect[i] = __atomic_load_n(&order[i]->state, __ATOMIC_ACQUIRE);
+    passes = 1;
+    do {
+      same = 1;
+      for (int i = 0; i < nitems; i++) {
+        again = __atomic_load_n(&order[i]->state, __ATOMIC_ACQUIRE);
+        if (again != collect[i]) {
+          collect[i] = again;
+          same = 0;
+        }
       }
-      V(&stock_item->mutex);
-    } else if (!strcmp(comp[0], "sell")) {
-      id = atoi(comp[1]);
-      stock = atoi(comp[2]);
-      item *stock_item = query_stock(stock_tree, id);
-      P(&stock_item->mutex);
-      if (stock_item == NULL) {
-        sprintf(status, "[sell] fail\n");
-        Rio_writen(connfd, status, MAXLINE);
-      } else {
-        stock_item->left_stock += stock;
-        sprintf(status, "[sell] success\n");
-        Rio_writen(connfd, status, MAXLINE);
+    } while (!same && (held || ++passes < SNAP_PASSES));
+    if (same)
+      break;
+    /* the list may change while trades are being held, so start over */
+    rcu_read_unlock();
+    hold_trades(HOLD_RENDER);
+    held = 1;
+  }
+
+  for (int i = 0; i < nitems; i++) {
+    len += sprintf(back.text + len, "%d %d %d\n", order[i]->ID,
+                   STATE_LEFT(collect[i]), order[i]->price);
+    back.recs[i].id = htonl(order[i]->ID);
+    back.recs[i].left = htonl(STATE_LEFT(collect[i]));
+    back.recs[i].price = htonl(order[i]->price);
+  }
+  back.len = len;
+  back.count = nitems;
+  back.version = version;
+
+  /* Publish under the seqlock; readers retry if they overlap this */
+  __atomic_store_n(&snap_seq, snap_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  old = snap;
+  snap = back;
+  back = old;
+  __atomic_store_n(&snap_seq, snap_seq + 1, __ATOMIC_RELEASE);
+  rcu_read_unlock();
+  if (held)
+    release_trades(HOLD_RENDER);
+}
+
+/*
+ * read_snapshot - Copy the text show reply, or the binary records if
+ * binary is set, into this thread's buffer and return it; *len is set to
+ * its size in bytes. Any rendering made after the call began will do, so
+ * trades arriving meanwhile cannot keep a reader re-rendering. Readers
+ * write no shared memory: a copy that overlapped a rendering is simply
+ * retried, and only a stale snapshot sends a reader to refresh_snapshot.
+ */
+static void *read_snapshot(int binary, size_t *len) {
+  static __thread char *copy[2]; /* this thread's text and binary copies */
+  static __thread size_t cap[2]; /* bytes allocated for them */
+  unsigned long want = __atomic_load_n(&table_version, __ATOMIC_ACQUIRE);
+  unsigned long version;
+  unsigned seq;
+  char *src;
+
+  rcu_read_lock();
+  while (1) {
+    seq = __atomic_load_n(&snap_seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) {
+      version = snap.version;
+      src = binary ? (char *)snap.recs : snap.text;
+      *len = binary ? snap.count * sizeof(bin_stock) : snap.len;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      /* src and len belong together only if no swap came in between */
+      if (__atomic_load_n(&snap_seq, __ATOMIC_RELAXED) == seq &&
+          version >= want) {
+        if (*len > cap[binary] || copy[binary] == NULL) {
+          cap[binary] = *len;
+          copy[binary] = Realloc(copy[binary], max(cap[binary], 1));
+        }
+        memcpy(copy[binary], src, *len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&snap_seq, __ATOMIC_RELAXED) == seq) {
+          rcu_read_unlock();
+          return copy[binary];
+        }
+        continue;
       }
-      V(&stock_item->mutex);
-    } else if (!strcmp(comp[0], "exit")) {
-      P(&mutex);
-      // send message to the client
-      sprintf(status, "exit\n");
-      Rio_writen(connfd, status, MAXLINE);
-      V(&mutex);
+    }
+    /* the refresh may hold trades, which waits for every read section */
+    rcu_read_unlock();
+    P(&snap_mutex);
+    refresh_snapshot(want);
+    V(&snap_mutex);
+    rcu_read_lock();
+  }
+}
+
+/* Return this thread's copy of the text show reply and its length */
+char *show_text(size_t *len) { return read_snapshot(0, len); }
+
+/* Return this thread's copy of the binary show records and their count */
+bin_stock *show_binary(int *count) {
+  size_t len;
+  bin_stock *rec = read_snapshot(1, &len);
+
+  *count = len / sizeof(bin_stock);
+  return rec;
+}
+
+/* Order by_price entries by price, highest first, then by ID */
+static int cmp_price(const void *a, const void *b) {
+  item *x = *(item **)a, *y = *(item **)b;
+
+  if (x->price != y->price)
+    return x->price > y->price ? -1 : 1;
+  return (x->ID > y->ID) - (x->ID < y->ID);
+}
+
+/* Restore the min-heap on left below slot i of the n records of heap */
+static void sift_down(bin_stock *heap, int n, int i) {
+  bin_stock tmp;
+  int c;
+
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n && (int)heap[c + 1].left < (int)heap[c].left)
+      c++;
+    if ((int)heap[i].left <= (int)heap[c].left)
       break;
+    tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+}
+
+/*
+ * top_stock - Collect the n stocks with the most left, most first, into
+ * rec. Counts change with every trade, so the table is scanned keeping the
+ * best n seen in a min-heap, which is then sorted in place.
+ */
+static int top_stock(universe_t *u, int n, bin_stock *rec) {
+  item **by_price = u->by_price;
+  int k = 0, total = u->count, left;
+  bin_stock tmp;
+
+  for (int i = 0; i < total && n > 0; i++) {
+    left = read_stock(by_price[i]);
+    if (k == n && left <= (int)rec[0].left)
+      continue;
+    if (k < n) {
+      /* grow the heap and let the new record climb to its place */
+      int j = k++;
+      while (j > 0 && (int)rec[(j - 1) / 2].left > left) {
+        rec[j] = rec[(j - 1) / 2];
+        j = (j - 1) / 2;
+      }
+      rec[j].id = by_price[i]->ID;
+      rec[j].left = left;
+      rec[j].price = by_price[i]->price;
+    } else {
+      rec[0].id = by_price[i]->ID;
+      rec[0].left = left;
+      rec[0].price = by_price[i]->price;
+      sift_down(rec, k, 0);
     }
   }
+  for (int i = k - 1; i > 0; i--) {
+    tmp = rec[0];
+    rec[0] = rec[i];
+    rec[i] = tmp;
+    sift_down(rec, i, 0);
+  }
+  return k;
+}
+
+/*
+ * query_stocks - Collect the stocks a request asks for into this thread's
+ * buffer, in host byte order, and set *count. OP_RANGE takes the stocks
+ * with IDs a..b in ID order; the subtree sizes count them beforehand, so
+ * the buffer is sized in O(log n). OP_TOP takes the a best stocks by key
+ * b: prices never change, so by_price already holds that ranking.
+ */
+bin_stock *query_stocks(int op, int a, int b, int *count) {
+  static __thread bin_stock *rec;
+  static __thread int cap;
+  universe_t *u;
+  int n;
+
+  rcu_read_lock();
+  u = __atomic_load_n(&universe, __ATOMIC_ACQUIRE);
+  if (op == OP_RANGE)
+    n = a > b ? 0
+              : count_below(u->tree, (long)b + 1) - count_below(u->tree, a);
+  else
+    n = max(0, min(a, u->count));
+  if (n > cap) {
+    cap = n;
+    rec = Realloc(rec, cap * sizeof(bin_stock));
+  }
+  if (op == OP_RANGE) {
+    *count = range_stocks(u->tree, a, b, rec);
+  } else if (b == TOP_PRICE) {
+    for (int i = 0; i < n; i++) {
+      rec[i].id = u->by_price[i]->ID;
+      rec[i].left = read_stock(u->by_price[i]);
+      rec[i].price = u->by_price[i]->price;
+    }
+    *count = n;
+  } else {
+    *count = top_stock(u, n, rec);
+  }
+  rcu_read_unlock();
+  return rec;
+}
+
+/* Render n host-order records as show lines in this thread's buffer */
+char *render_stocks(bin_stock *rec, int n, size_t *len) {
+  static __thread char *buf;
+  static __thread int cap;
+
+  if (n > cap || buf == NULL) {
+    cap = n;
+    buf = Realloc(buf, max(cap, 1) * SHOW_LINE);
+  }
+  *len = 0;
+  for (int i = 0; i < n; i++)
+    *len += sprintf(buf + *len, "%d %d %d\n", (int)rec[i].id, (int)rec[i].left,
+                    (int)rec[i].price);
+  return buf;
+}
+
+/*
+ * make_universe - Wrap tree and order, the count stocks of a version, in a
+ * universe with its price ranking and ID index. Admin changes are rare,
+ * so both are simply rebuilt for each one.
+ */
+static universe_t *make_universe(node *tree, item **order, int count) {
+  universe_t *u = Malloc(sizeof(universe_t));
+  int lo = 0, hi = 0;
+
+  u->tree = tree;
+  u->count = count;
+  u->order = order;
+  u->by_price = Malloc(max(count, 1) * sizeof(item *));
+  memcpy(u->by_price, order, count * sizeof(item *));
+  qsort(u->by_price, count, sizeof(item *), cmp_price);
+  for (int i = 0; i < count; i++) {
+    if (i == 0 || order[i]->ID < lo)
+      lo = order[i]->ID;
+    if (i == 0 || order[i]->ID > hi)
+      hi = order[i]->ID;
+  }
+  index_init(&u->index, index_choice, count, lo, hi);
+  for (int i = 0; i < count; i++)
+    index_insert(&u->index, order[i]->ID, order[i]);
+  return u;
+}
+
+/*
+ * publish - Make next the universe readers see, free the old one once no
+ * reader holds it, and checkpoint, so the change survives a restart
+ * without the journal having to record it. Called with admin_mutex held.
+ */
+static void publish(universe_t *next) {
+  universe_t *old = universe;
+
+  __atomic_store_n(&universe, next, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&table_version, 1, __ATOMIC_RELEASE);
+  rcu_retire(old->order);
+  rcu_retire(old->by_price);
+  index_free(&old->index, rcu_retire);
+  rcu_retire(old);
+  rcu_synchronize();
+  save_stocks();
+}
+
+/*
+ * list: add stock id with left shares at price; 0 if it is already listed,
+ * and -1 if a successor has the stocks
+ */
+int list_stock(int id, int left, int price) {
+  universe_t *u;
+  item **order;
+  node *tree;
+  long lo = id, hi = id;
+
+  P(&admin_mutex);
+  if (handed_off()) {
+    V(&admin_mutex);
+    return -1;
+  }
+  u = universe;
+  for (int i = 0; i < u->count; i++) {
+    lo = min(lo, u->order[i]->ID);
+    hi = max(hi, u->order[i]->ID);
+  }
+  if (left < 0 || query_stock(u->tree, id) != NULL ||
+      (index_choice == INDEX_DIRECT && hi - lo >= INDEX_DIRECT_MAX)) {
+    V(&admin_mutex);
+    return 0;
+  }
+  tree_gen++;
+  tree = insert_stock(u->tree, id, left, price);
+  order = Malloc((u->count + 1) * sizeof(item *));
+  memcpy(order, u->order, u->count * sizeof(item *));
+  order[u->count] = query_stock(tree, id);
+  publish(make_universe(tree, order, u->count + 1));
+  V(&admin_mutex);
+  return 1;
+}
+
+/*
+ * delist: remove stock id from the market; 0 if it is not listed, and -1
+ * if a successor has the stocks
+ */
+int delist_stock(int id) {
+  universe_t *u;
+  item **order, *s;
+  node *tree;
+  int n = 0;
+
+  P(&admin_mutex);
+  if (handed_off()) {
+    V(&admin_mutex);
+    return -1;
+  }
+  u = universe;
+  if ((s = query_stock(u->tree, id)) == NULL) {
+    V(&admin_mutex);
+    return 0;
+  }
+  tree_gen++;
+  tree = delete_stock(u->tree, id);
+  order = Malloc(max(u->count - 1, 1) * sizeof(item *));
+  for (int i = 0; i < u->count; i++)
+    if (u->order[i] != s)
+      order[n++] = u->order[i];
+  publish(make_universe(tree, order, n));
+  /* trades in flight have ended; items of stock.txt stay in their array */
+  if (s < items || s >= items + stock_cap)
+    Free(s);
+  V(&admin_mutex);
+  return 1;
+}
 
-  /* Save the stock tree to the file */
-  P(&mutex);
-  fp = Fopen("stock.txt", "w");
-  memset(result, '\0', MAXLINE);
-  for (int i = 0; i < STOCK_NUM; i++) {
-    if (order[i]) {
-      sprintf(status, "%d %d %d\n", order[i]->ID, order[i]->left_stock,
-              order[i]->price);
-      strcat(result, status);
+/*
+ * buy_stock - Buy stock shares of id; returns 0 if it is unknown or not
+ * enough are left, and -1 if a successor has the stocks. The check and
+ * the decrement are one compare-and-swap, retried while other workers
+ * trade the same stock. The trade is journaled
+ * inside the read section, which it enters through the trade gate, so a
+ * delist's checkpoint comes after it, and *seq gets its record, which the
+ * reply waits for.
+ */
+int buy_stock(int id, int stock, unsigned long *seq) {
+  item *stock_item;
+  uint64_t old, new;
+
+  if (!enter_trade())
+    return -1;
+  if ((stock_item = find_stock(id)) == NULL) {
+    rcu_read_unlock();
+    return 0;
+  }
+  old = __atomic_load_n(&stock_item->state, __ATOMIC_RELAXED);
+  do {
+    if (STATE_LEFT(old) < stock) {
+      rcu_read_unlock();
+      return 0;
     }
+    new = STATE(STATE_VERSION(old) + 1, STATE_LEFT(old) - stock);
+  } while (!__atomic_compare_exchange_n(&stock_item->state, &old, new, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  *seq = journal_append(id, STATE_LEFT(new), STATE_VERSION(new));
+  rcu_read_unlock();
+  __atomic_add_fetch(&table_version, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * sell_stock - Sell stock shares of id; returns 0 if it is unknown, and -1
+ * if a successor has the stocks. A compare-and-swap as well, since the
+ * trade count moves with the stocks.
+ */
+int sell_stock(int id, int stock, unsigned long *seq) {
+  item *stock_item;
+  uint64_t old, new;
+
+  if (!enter_trade())
+    return -1;
+  if ((stock_item = find_stock(id)) == NULL) {
+    rcu_read_unlock();
+    return 0;
   }
-  Write(fileno(fp), result, strlen(result));
+  old = __atomic_load_n(&stock_item->state, __ATOMIC_RELAXED);
+  do {
+    new = STATE(STATE_VERSION(old) + 1, STATE_LEFT(old) + stock);
+  } while (!__atomic_compare_exchange_n(&stock_item->state, &old, new, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  *seq = journal_append(id, STATE_LEFT(new), STATE_VERSION(new));
+  rcu_read_unlock();
+  __atomic_add_fetch(&table_version, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * enter_trade - Enter the read section of a trade once trades are not
+ * held. A holder sets its bit before it waits out the read sections, and
+ * a trade reads the bits after it entered one, so either the holder waits
+ * for the trade or the trade sees the bit and waits for the holder.
+ * Returns 0, outside the read section, once a successor has the stocks.
+ */
+static int enter_trade(void) {
+  int held;
+
+  while (1) {
+    rcu_read_lock();
+    if (!(held = __atomic_load_n(&trades_held, __ATOMIC_ACQUIRE)))
+      return 1;
+    rcu_read_unlock();
+    if (held & HOLD_HANDOFF)
+      return 0;
+    sched_yield();
+  }
+}
+
+/* Keep trades away from the table for why: return once none is under way */
+static void hold_trades(int why) {
+  __atomic_fetch_or(&trades_held, why, __ATOMIC_SEQ_CST);
+  rcu_synchronize();
+}
+
+/* Let the trades held for why go on */
+static void release_trades(int why) {
+  __atomic_fetch_and(&trades_held, ~why, __ATOMIC_RELEASE);
+}
+
+/* Return nonzero once the stocks went to a successor */
+static int handed_off(void) {
+  return __atomic_load_n(&trades_held, __ATOMIC_ACQUIRE) & HOLD_HANDOFF;
+}
+
+/*
+ * cutover - Stop trading for good and return the stocks for a successor,
+ * with their count and trade counts. The trades under way are waited out
+ * and a list or delist under way is let finish, so the copy is final.
+ * Checkpoints end here, as stock.txt and the journal are the successor's
+ * from now on, and the journal is committed, so the replies held for it
+ * go out.
+ */
+static bin_stock *cutover(int *count, unsigned **version) {
+  bin_stock *rec;
+
+  hold_trades(HOLD_HANDOFF);
+  P(&admin_mutex);
+  P(&save_mutex); /* never given back */
+  journal_flush();
+  rec = copy_stocks(count, version);
+  V(&admin_mutex);
+  return rec;
+}
+
+/*
+ * save_stocks - checkpoint the stock table to stock.txt. The journal is
+ * rotated before the table is copied, so a trade is in the copy, in the
+ * new journal or in both, which replay tolerates. Each stock is written
+ * with its trade count: a trade may swap the state before an earlier one
+ * is journaled, so the new journal can hold a record older than the copy,
+ * and replay must be able to tell it is stale. The copy goes to a
+ * temporary that replaces stock.txt only once it is complete and on disk.
+ * The flusher and list/delist both checkpoint, one at a time.
+ */
+void save_stocks(void) {
+  bin_stock *rec;
+  unsigned *version;
+  int n;
+  FILE *fp;
+
+  P(&save_mutex);
+  if (universe == NULL) { /* freed by stop_server */
+    V(&save_mutex);
+    return;
+  }
+  journal_rotate();
+  rec = copy_stocks(&n, &version);
+
+  fp = Fopen("stock.txt.tmp", "w");
+  for (int i = 0; i < n; i++)
+    fprintf(fp, "%d %d %d %u\n", (int)rec[i].id, (int)rec[i].left,
+            (int)rec[i].price, version[i]);
+  Free(rec);
+  Free(version);
+  if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+    unix_error("fsync error");
   Fclose(fp);
-  V(&mutex);
+  if (rename("stock.txt.tmp", "stock.txt") < 0)
+    unix_error("rename error");
+  journal_retire();
+  V(&save_mutex);
+}
+
+/*
+ * copy the published stocks, in the order they were listed, with their
+ * count, and their trade counts into a Malloc'd *version
+ */
+static bin_stock *copy_stocks(int *count, unsigned **version) {
+  universe_t *u;
+  bin_stock *rec;
+  uint64_t state;
+
+  rcu_read_lock();
+  u = __atomic_load_n(&universe, __ATOMIC_ACQUIRE);
+  *count = u->count;
+  rec = Malloc(max(u->count, 1) * sizeof(bin_stock));
+  *version = Malloc(max(u->count, 1) * sizeof(unsigned));
+  for (int i = 0; i < u->count; i++) {
+    state = __atomic_load_n(&u->order[i]->state, __ATOMIC_ACQUIRE);
+    rec[i].id = u->order[i]->ID;
+    rec[i].left = STATE_LEFT(state);
+    rec[i].price = u->order[i]->price;
+    (*version)[i] = STATE_VERSION(state);
+  }
+  rcu_read_unlock();
+  return rec;
+}
+
+/*
+ * parse the "id left price [trades]" lines of stock.txt into records, with
+ * their count, and the trade counts into a Malloc'd *version; a line
+ * without one, as the original stock.txt has, counts none
+ */
+static bin_stock *read_stocks(int *count, unsigned **version) {
+  char status[MAXLINE], *stateptr, *trades;
+  bin_stock *rec;
+  int n = 0;
+  FILE *fp;
+
+  fp = Fopen("stock.txt", "r");
+  /* every line holds at most one new stock */
+  while (Fgets(status, MAXLINE, fp) != NULL)
+    n++;
+  rewind(fp);
+  rec = Malloc(max(n, 1) * sizeof(bin_stock));
+  *version = Malloc(max(n, 1) * sizeof(unsigned));
+  *count = 0;
+  while (*count < n && Fgets(status, MAXLINE, fp) != NULL) {
+    rec[*count].id = atoi(strtok_r(status, " ", &stateptr));
+    rec[*count].left = atoi(strtok_r(NULL, " ", &stateptr));
+    rec[*count].price = atoi(strtok_r(NULL, " \n", &stateptr));
+    trades = strtok_r(NULL, " \n", &stateptr);
+    (*version)[*count] = trades ? strtoul(trades, NULL, 10) : 0;
+    (*count)++;
+  }
+  Fclose(fp);
+  return rec;
+}
+
+/*
+ * set the left stock of id as a journal record says, unless it is stale.
+ * Replay runs before any worker, so no read section is needed.
+ */
+void apply_record(int id, int left, unsigned version) {
+  item *stock_item = find_stock(id);
+
+  if (stock_item != NULL &&
+      (int)(version - STATE_VERSION(stock_item->state)) > 0)
+    stock_item->state = STATE(version, left);
+}
+
+/*
+ * send_reply - Queue the len-byte reply in buf on batch b. Legacy clients
+ * read exactly MAXLINE bytes per reply, so it is NUL-padded for them from a
+ * shared zero page and a longer show is cut after its last whole line; a
+ * framed client only gets a header and the payload. A payload too large to
+ * copy is written straight from buf along with what is already queued.
+ */
+void send_reply(batch_t *b, char *buf, size_t len) {
+  static char zeros[MAXLINE];
+  char *start, *cut;
+  struct iovec *last;
+  int large; /* sent from buf itself */
+
+  if (b->padded && len >= MAXLINE) {
+    for (cut = buf + MAXLINE - 1; cut > buf && cut[-1] != '\n'; cut--)
+      ;
+    len = cut - buf;
+  }
+  large = len > BATCH_BUF - PROTO_FRAMEHDR;
+  if (b->iovcnt + 2 > BATCH_IOV ||
+      b->used + PROTO_FRAMEHDR + (large ? 0 : len) > BATCH_BUF)
+    flush_replies(b);
+  start = b->buf + b->used;
+  if (b->framed)
+    b->used += sprintf(start, "%zu\n", len);
+  if (!large) {
+    memcpy(b->buf + b->used, buf, len);
+    b->used += len;
+  }
+
+  /* Back-to-back copies share a segment until padding splits them */
+  last = b->iovcnt > 0 ? &b->iov[b->iovcnt - 1] : NULL;
+  if (last && (char *)last->iov_base + last->iov_len == start) {
+    last->iov_len += b->buf + b->used - start;
+  } else if (b->buf + b->used > start) {
+    b->iov[b->iovcnt].iov_base = start;
+    b->iov[b->iovcnt++].iov_len = b->buf + b->used - start;
+  }
+  if (large) {
+    /* buf is only borrowed, so it goes out before the caller reuses it */
+    b->iov[b->iovcnt].iov_base = buf;
+    b->iov[b->iovcnt++].iov_len = len;
+    flush_replies(b);
+  } else if (b->padded) {
+    b->iov[b->iovcnt].iov_base = zeros;
+    b->iov[b->iovcnt++].iov_len = MAXLINE - len;
+  }
+}
+
+/*
+ * flush_replies - Write every queued reply of batch b with one writev,
+ * once the journal has the trades they report on disk. A connection-mode
+ * worker waits for that, which is the group commit: the replies of every
+ * worker trading meanwhile ride on the same fdatasync. A request-mode
+ * worker never does; replies the journal holds back are copied to the
+ * connection, with every later one of the task to keep them in order, and
+ * the I/O thread writes them after the commit.
+ */
+void flush_replies(batch_t *b) {
+  conn_t *c = b->conn;
+
+  if (b->iovcnt > 0 && c != NULL &&
+      (c->out != NULL || !journal_durable(b->seq))) {
+    for (int i = 0; i < b->iovcnt; i++) {
+      if (c->outlen + b->iov[i].iov_len > c->outcap) {
+        c->outcap = max(2 * c->outcap, c->outlen + b->iov[i].iov_len);
+        c->out = Realloc(c->out, c->outcap);
+      }
+      memcpy(c->out + c->outlen, b->iov[i].iov_base, b->iov[i].iov_len);
+      c->outlen += b->iov[i].iov_len;
+    }
+    c->seq = b->seq;
+  } else if (b->iovcnt > 0) {
+    journal_wait(b->seq);
+    Rio_writevn(b->fd, b->iov, b->iovcnt);
+  }
+  b->iovcnt = 0;
+  b->used = 0;
 }
 
 /* thread function */
 void *thread(void *args) {
   Pthread_detach(Pthread_self());
+  int connfd;
+
+  /* grown after main took the I/O cores, it would inherit them unpinned */
+  if (worker_cpus.n > 0)
+    affinity_pin_one(&worker_cpus,
+                     __atomic_fetch_add(&nstarted, 1, __ATOMIC_RELAXED));
+  else
+    affinity_pin(&main_cpus);
+
   while (1) {
-    int connfd = sbuf_remove(&sbuf);
+    if (!mpmc_timed_pop(&sbuf, IDLE_MS, &connfd)) {
+      /* idle: leave unless the pool is at its minimum or a client came
+       * in meanwhile; grow_workers sees the count drop before it decides */
+      P(&workers.mutex);
+      if (workers.nthreads > workers.min && mpmc_count(&sbuf) == 0) {
+        workers.nthreads--;
+        V(&workers.mutex);
+        return NULL;
+      }
+      V(&workers.mutex);
+      continue;
+    }
+    __atomic_add_fetch(&workers.busy, 1, __ATOMIC_SEQ_CST);
     check_order(connfd);
+    /* cleared first: Accept may reuse connfd once it is closed */
+    if (connfd < nconns)
+      __atomic_store_n(&held[connfd], 0, __ATOMIC_RELAXED);
     Close(connfd);
+    __atomic_sub_fetch(&workers.busy, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&workers.inflight, 1, __ATOMIC_SEQ_CST);
   }
 }
 
-/* Create an empty, bounded, shared FIFO buffer with n slots */
-/* $begin sbuf_init */
-void sbuf_init(sbuf_t *sp, int n) {
-  sp->buf = Calloc(n, sizeof(int));
-  sp->n = n;                  /* Buffer holds max of n items */
-  sp->front = sp->rear = 0;   /* Empty buffer iff front == rear */
-  Sem_init(&sp->mutex, 0, 1); /* Binary semaphore for locking */
-  Sem_init(&sp->slots, 0, n); /* Initially, buf has n empty slots */
-  Sem_init(&sp->items, 0, 0); /* Initially, buf has zero data items */
-}
-/* $end sbuf_init */
-
-/* Clean up buffer sp */
-/* $begin sbuf_deinit */
-void sbuf_deinit(sbuf_t *sp) { Free(sp->buf); }
-/* $end sbuf_deinit */
-
-/* Insert item onto the rear of shared buffer sp */
-/* $begin sbuf_insert */
-void sbuf_insert(sbuf_t *sp, int item) {
-  P(&sp->slots);                          /* Wait for available slot */
-  P(&sp->mutex);                          /* Lock the buffer */
-  sp->buf[(++sp->rear) % (sp->n)] = item; /* Insert the item */
-  V(&sp->mutex);                          /* Unlock the buffer */
-  V(&sp->items);                          /* Announce available item */
-}
-/* $end sbuf_insert */
-
-/* Remove and return the first item from buffer sp */
-/* $begin sbuf_remove */
-int sbuf_remove(sbuf_t *sp) {
-  int item;
-  P(&sp->items);                           /* Wait for available item */
-  P(&sp->mutex);                           /* Lock the buffer */
-  item = sp->buf[(++sp->front) % (sp->n)]; /* Remove the item */
-  V(&sp->mutex);                           /* Unlock the buffer */
-  V(&sp->slots);                           /* Announce available slot */
-  return item;
-}
-/* $end sbuf_remove */
-/* $end sbufc */
+/* add a worker if more connections wait than workers are idle */
+void grow_workers(void) {
+  pthread_t tid;
+
+  P(&workers.mutex);
+  if (workers.nthreads < workers.max &&
+      mpmc_count(&sbuf) >
+          workers.nthreads - __atomic_load_n(&workers.busy, __ATOMIC_SEQ_CST)) {
+    workers.nthreads++;
+    Pthread_create(&tid, NULL, thread, NULL);
+  }
+  V(&workers.mutex);
+}
+
+/*
+ * steal_worker - Worker of the request mode; vargp is its number. It pins
+ * itself before it allocates its counters and deque, so they land on the
+ * memory node of its core, like the buffers it grows for replies.
+ */
+void *steal_worker(void *vargp) {
+  Pthread_detach(Pthread_self());
+  int self = (int)(long)vargp, fd, rc;
+  stealer_t *me = NULL;
+
+  affinity_pin_one(&worker_cpus, self);
+  if ((rc = posix_memalign((void **)&me, CACHELINE, sizeof(stealer_t))) != 0)
+    posix_error(rc, "posix_memalign error");
+  memset(me, 0, sizeof(stealer_t));
+  wsdeque_init(&me->tasks, deque_slots);
+  stealers[self] = me;
+  pthread_barrier_wait(&started); /* others' deques are stolen from */
+
+  while (1) {
+    if (!take_task(self, &fd)) {
+      /* look once more after counting as idle, so no deal goes unseen */
+      mpmc_lot_enter(&idle);
+      if (!take_task(self, &fd)) {
+        mpmc_lot_sleep(&idle, NULL);
+        continue;
+      }
+      mpmc_lot_leave(&idle);
+    }
+    __atomic_add_fetch(&workers.busy, 1, __ATOMIC_SEQ_CST);
+    serve_task(fd);
+    __atomic_sub_fetch(&workers.busy, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&workers.inflight, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&me->served, me->served + 1, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * take_task - Take the first task of worker self's deque, or else steal
+ * the first of the next worker's that has one. Returns 0 if every deque
+ * was empty.
+ */
+static int take_task(int self, int *fd) {
+  stealer_t *me = stealers[self];
+  wsdeque_t *d;
+  int rc;
+
+  for (int k = 0; k < nstealers; k++) {
+    d = &stealers[(self + k) % nstealers]->tasks;
+    while ((rc = wsdeque_take(d, fd)) < 0)
+      ; /* another worker took that task: look at the next one */
+    if (rc == 0)
+      continue;
+    if (k > 0)
+      __atomic_store_n(&me->stolen, me->stolen + 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * deal_task - Push fd onto the deque of the next worker in turn, or of the
+ * one after it if that deque is full, and wake an idle worker, which
+ * steals the task if its owner is busy. Only the I/O thread deals.
+ */
+static void deal_task(int fd) {
+  static int next; /* worker dealt to next */
+  stealer_t *w;
+
+  while (1) {
+    for (int k = 0; k < nstealers; k++) {
+      w = stealers[next];
+      next = (next + 1) % nstealers;
+      if (wsdeque_push(&w->tasks, fd)) {
+        __atomic_add_fetch(&workers.inflight, 1, __ATOMIC_SEQ_CST);
+        mpmc_lot_wake(&idle);
+        return;
+      }
+    }
+    sched_yield(); /* every deque is full: let the workers catch up */
+  }
+}
+
+/*
+ * render_stats - Describe the load of the workers in this thread's
+ * buffer. The request mode gives a line per worker with the tasks it
+ * served, how many of them it stole and the tasks left in its deque; the
+ * connection mode gives the pool size, the busy workers and the
+ * connections waiting in sbuf.
+ */
+char *render_stats(size_t *len) {
+  static __thread char *buf;
+  static __thread int cap;
+  int n = per_request ? nstealers : 1;
+
+  if (n > cap || buf == NULL) {
+    cap = n;
+    buf = Realloc(buf, cap * STATS_LINE);
+  }
+  if (!per_request) {
+    *len = sprintf(buf, "workers %d busy %d queued %d\n",
+                   __atomic_load_n(&workers.nthreads, __ATOMIC_RELAXED),
+                   __atomic_load_n(&workers.busy, __ATOMIC_RELAXED),
+                   mpmc_count(&sbuf));
+    return buf;
+  }
+  *len = 0;
+  for (int i = 0; i < n; i++)
+    *len += sprintf(buf + *len, "worker %d served %lu stolen %lu depth %d\n",
+                    i, __atomic_load_n(&stealers[i]->served, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stealers[i]->stolen, __ATOMIC_RELAXED),
+                    wsdeque_count(&stealers[i]->tasks));
+  return buf;
+}
 
 /* Rotate the tree to the left */
 node *left_rotate(node *x) {
-  node *y = x->right;
+  x = fresh(x);
+  node *y = x->right = fresh(x->right);
   node *T2 = y->left;
 
   y->left = x;
   x->right = T2;
 
-  x->height = max(height(x->left), height(x->right)) + 1;
-  y->height = max(height(y->left), height(y->right)) + 1;
+  update_node(x);
+  update_node(y);
 
   return y;
 }
 
 /* Rotate the tree to the right */
 node *right_rotate(node *y) {
-  node *x = y->left;
+  y = fresh(y);
+  node *x = y->left = fresh(y->left);
   node *T2 = x->right;
 
   x->right = y;
   y->left = T2;
 
-  y->height = max(height(y->left), height(y->right)) + 1;
-  x->height = max(height(x->left), height(x->right)) + 1;
+  update_node(y);
+  update_node(x);
 
   return x;
 }
@@ -323,102 +1992,147 @@ int get_balance(node *n) {
 /* Get the height of the tree */
 int height(node *n) { return n == NULL ? 0 : n->height; }
 
-/* Insert the node into the tree */
+/* Get the number of stocks in the tree */
+int tree_size(node *n) { return n == NULL ? 0 : n->size; }
+
+/* Recompute the height and the size of n from its children */
+void update_node(node *n) {
+  n->height = max(height(n->left), height(n->right)) + 1;
+  n->size = tree_size(n->left) + tree_size(n->right) + 1;
+}
+
+/*
+ * insert_stock - Insert the stock into the tree and return its new root.
+ * Nodes made before this update are copied before they change, so
+ * readers of the old root keep an intact tree.
+ */
 node *insert_stock(node *tree, int id, int left_stock, int price) {
   if (tree == NULL) {
-    item *z = malloc(sizeof(item));
-    z->ID = id;
-    z->left_stock = left_stock;
-    z->price = price;
-    z->read_cnt = 0;
-    Sem_init(&z->mutex, 0, 1);
     node *new_node = malloc(sizeof(node));
-    new_node->stock = z;
+    new_node->stock = new_item(id, left_stock, price);
     new_node->left = new_node->right = NULL;
     new_node->height = 1;
+    new_node->size = 1;
+    new_node->gen = tree_gen;
     return new_node;
   }
 
-  if (id < tree->stock->ID)
-    tree->left = insert_stock(tree->left, id, left_stock, price);
-  else if (id > tree->stock->ID)
-    tree->right = insert_stock(tree->right, id, left_stock, price);
-  else {
-    tree->stock->left_stock = left_stock;
+  if (id == tree->stock->ID) {
+    tree->stock->state = STATE(0, left_stock);
     tree->stock->price = price;
     return tree;
   }
 
-  tree->height = 1 + max(height(tree->left), height(tree->right));
+  tree = fresh(tree);
+  if (id < tree->stock->ID)
+    tree->left = insert_stock(tree->left, id, left_stock, price);
+  else
+    tree->right = insert_stock(tree->right, id, left_stock, price);
 
-  int balance = get_balance(tree);
+  return rebalance(tree);
+}
 
-  if (balance > 1 && id < tree->left->stock->ID)
-    return right_rotate(tree);
+/*
+ * delete_stock - Delete the stock from the tree and return its new root.
+ * A node with two children takes the stock of its successor, whose node
+ * is deleted instead. Copies nodes as insert_stock does.
+ */
+node *delete_stock(node *tree, int id) {
+  node *child, *succ;
 
-  if (balance < -1 && id > tree->right->stock->ID)
-    return left_rotate(tree);
+  if (tree == NULL)
+    return NULL; // Not found
 
-  if (balance > 1 && id > tree->left->stock->ID) {
-    tree->left = left_rotate(tree->left);
-    return right_rotate(tree);
+  if (id < tree->stock->ID) {
+    tree = fresh(tree);
+    tree->left = delete_stock(tree->left, id);
+  } else if (id > tree->stock->ID) {
+    tree = fresh(tree);
+    tree->right = delete_stock(tree->right, id);
+  } else if (tree->left == NULL || tree->right == NULL) {
+    // One or zero children: the child takes the place of the node
+    child = (tree->left != NULL) ? tree->left : tree->right;
+    discard(tree);
+    return child;
+  } else {
+    // Two children: move the successor's stock up
+    for (succ = tree->right; succ->left != NULL; succ = succ->left)
+      ;
+    tree = fresh(tree);
+    tree->stock = succ->stock;
+    tree->right = delete_stock(tree->right, succ->stock->ID);
   }
 
-  if (balance < -1 && id < tree->right->stock->ID) {
-    tree->right = right_rotate(tree->right);
-    return left_rotate(tree);
-  }
+  return rebalance(tree);
+}
+
+/* Return n, or a copy of it if readers may hold n; the copy retires n */
+static node *fresh(node *n) {
+  node *copy;
 
-  return tree;
+  if (n->gen == tree_gen)
+    return n;
+  copy = Malloc(sizeof(node));
+  *copy = *n;
+  copy->gen = tree_gen;
+  rcu_retire(n);
+  return copy;
 }
 
-/* Delete the node from the tree */
-void delete_stock(node *tree, int id) {
-  node *current = tree->left;
-  node *parent = NULL;
+/* Free n, which the update took out of the tree, once readers are done */
+static void discard(node *n) {
+  if (n->gen == tree_gen)
+    Free(n);
+  else
+    rcu_retire(n);
+}
 
-  // Find node to delete
-  while (current != NULL && current->stock->ID != id) {
-    parent = current;
-    if (id < current->stock->ID)
-      current = current->left;
-    else
-      current = current->right;
-  }
+/* Free every node of tree n, which no reader can reach any more */
+static void free_tree(node *n) {
+  if (n == NULL)
+    return;
+  free_tree(n->left);
+  free_tree(n->right);
+  Free(n);
+}
 
-  if (current == NULL)
-    return; // Not found
+/* Update n, which the update may change, and rotate it back into balance */
+static node *rebalance(node *n) {
+  int balance;
 
-  node *target = current;
+  update_node(n);
+  balance = get_balance(n);
 
-  // Case: two children
-  if (target->left != NULL && target->right != NULL) {
-    node *succ = target->right;
-    while (succ->left != NULL)
-      succ = succ->left;
+  if (balance > 1) {
+    if (get_balance(n->left) < 0)
+      n->left = left_rotate(n->left);
+    return right_rotate(n);
+  }
 
-    // Copy successor data into target
-    target->stock = succ->stock;
+  if (balance < -1) {
+    if (get_balance(n->right) > 0)
+      n->right = right_rotate(n->right);
+    return left_rotate(n);
+  }
 
-    // Remove successor node
-    node *to_delete = succ;
-    succ = to_delete->right;
-    sem_destroy(&to_delete->stock->mutex);
-    free(to_delete);
-  } else {
-    // One or zero children
-    node *child = (target->left != NULL) ? target->left : target->right;
+  return n;
+}
 
-    if (parent == NULL) {
-      // Handle case where root node is deleted
-      tree->left = child;
-    } else {
-      current = child;
-    }
+/* Take the next slot of items, or allocate a stock listed at runtime */
+static item *new_item(int id, int left_stock, int price) {
+  item *z = NULL;
+  int rc;
 
-    sem_destroy(&target->stock->mutex);
-    free(target);
+  if (nitems < stock_cap) {
+    z = &items[nitems++];
+  } else if ((rc = posix_memalign((void **)&z, CACHELINE, sizeof(item))) !=
+             0) {
+    posix_error(rc, "posix_memalign error");
   }
+  z->ID = id;
+  z->state = STATE(0, left_stock);
+  z->price = price;
+  return z;
 }
 
 /* Find a specific node from the tree */
@@ -436,4 +2150,50 @@ item *query_stock(node *tree, int id) {
       current = current->right;
   }
   return NULL;
-}
\ No newline at end of file
+}
+
+/*
+ * Find a stock of the published universe through its ID index, or its
+ * tree if it has none. Callers stay in a read section while they use it.
+ */
+item *find_stock(int id) {
+  universe_t *u = __atomic_load_n(&universe, __ATOMIC_ACQUIRE);
+
+  if (u->index.kind == INDEX_TREE)
+    return query_stock(u->tree, id);
+  return index_find(&u->index, id);
+}
+
+/* Count the stocks of the tree with IDs below id, in O(log n) */
+int count_below(node *tree, long id) {
+  int n = 0;
+
+  while (tree != NULL) {
+    if (tree->stock->ID < id) {
+      n += tree_size(tree->left) + 1;
+      tree = tree->right;
+    } else {
+      tree = tree->left;
+    }
+  }
+  return n;
+}
+
+/* Collect the stocks of the tree with IDs in lo..hi into rec, in order */
+int range_stocks(node *tree, int lo, int hi, bin_stock *rec) {
+  int n = 0;
+
+  if (tree == NULL)
+    return 0;
+  if (lo < tree->stock->ID)
+    n += range_stocks(tree->left, lo, hi, rec);
+  if (lo <= tree->stock->ID && tree->stock->ID <= hi) {
+    rec[n].id = tree->stock->ID;
+    rec[n].left = read_stock(tree->stock);
+    rec[n].price = tree->stock->price;
+    n++;
+  }
+  if (tree->stock->ID < hi)
+    n += range_stocks(tree->right, lo, hi, rec + n);
+  return n;
+}
@@ -0,0 +1,87 @@
+/*
+ * stop.c - SIGINT and SIGTERM as a readable descriptor (see stop.h)
+ */
+#include "csapp.h"
+#include "stop.h"
+
+static void *stop_thread(void *vargp); /* Waits for the signals */
+static int stop(int s);                /* Stops once, for successor s */
+
+static sigset_t signals;  /* SIGINT and SIGTERM */
+static int pipefd[2];     /* Written once the server stops */
+static int stopping;      /* Set once the server stops */
+static int successor = -1; /* Socket of the successor, set before stopping */
+static sem_t smutex;      /* Lets only the first stop through */
+
+/*
+ * stop_init - Block SIGINT and SIGTERM and start the thread that waits
+ * for them; call it before creating any other thread, which inherits the
+ * mask. Returns the read end of the pipe.
+ */
+int stop_init(void) {
+  pthread_t tid;
+  int rc;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if ((rc = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0)
+    posix_error(rc, "pthread_sigmask error");
+  if (pipe(pipefd) < 0)
+    unix_error("pipe error");
+  Sem_init(&smutex, 0, 1);
+  Pthread_create(&tid, NULL, stop_thread, NULL);
+  return pipefd[0];
+}
+
+/* Return 1 once SIGINT or SIGTERM arrived, or a successor took over */
+int stop_requested(void) {
+  return __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+}
+
+/* Stop for the successor on s; returns 0 if the server was stopping */
+int stop_handoff(int s) { return stop(s); }
+
+/* Return the socket of the successor, or -1 for a plain stop */
+int stop_successor(void) {
+  return stop_requested() ? successor : -1;
+}
+
+/* Return a monotonic clock in milliseconds, for drain deadlines */
+long stop_clock(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/* Wait for the first of the signals, then make the pipe readable */
+static void *stop_thread(void *vargp) {
+  int sig, rc;
+
+  Pthread_detach(pthread_self());
+  if ((rc = sigwait(&signals, &sig)) != 0)
+    posix_error(rc, "sigwait error");
+  printf("stopping on signal %d\n", sig);
+  fflush(stdout);
+  stop(-1);
+  return NULL;
+}
+
+/*
+ * stop - Stop the server unless it already is, for successor s or -1.
+ * The successor is set before the flag, so whoever sees the server
+ * stopping sees the successor too, and it never changes afterwards.
+ */
+static int stop(int s) {
+  int first;
+
+  P(&smutex);
+  if ((first = !stopping)) {
+    successor = s;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    Write(pipefd[1], "", 1);
+  }
+  V(&smutex);
+  return first;
+}
@@ -0,0 +1,32 @@
+/*
+ * stop.h - SIGINT and SIGTERM as a readable descriptor for the servers
+ *
+ * stop_init blocks both signals in the calling thread, and so in every
+ * thread it creates afterwards, and starts a thread that waits for them.
+ * When one arrives, that thread makes a pipe readable. Event loops watch
+ * the pipe beside their sockets, and as it is never drained, every loop
+ * sees it. No handler runs, so no blocking call is ever interrupted.
+ * A hot upgrade stops the server the same way, with the socket of the
+ * successor it is handed to.
+ */
+#ifndef __STOP_H__
+#define __STOP_H__
+
+#define DRAIN_MS 5000 /* Default time a stopping server gives its clients */
+
+/* Start watching for the signals; returns the pipe to watch */
+int stop_init(void);
+
+/* Return 1 once SIGINT or SIGTERM arrived, or a successor took over */
+int stop_requested(void);
+
+/* Stop for the successor on s; returns 0 if the server was stopping */
+int stop_handoff(int s);
+
+/* Return the socket of the successor, or -1 for a plain stop */
+int stop_successor(void);
+
+/* Return a monotonic clock in milliseconds, for drain deadlines */
+long stop_clock(void);
+
+#endif /* __STOP_H__ */
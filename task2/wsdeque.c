@@ -0,0 +1,71 @@
+/*
+ * wsdeque.c - Work-stealing deque of ints with one producer (see wsdeque.h)
+ *
+ * The items from top to bottom - 1 are in the deque. The producer
+ * publishes a push by storing bottom after the item, and only it ever
+ * moves bottom. A consumer reads top, then bottom, and claims the item at
+ * top with a compare-and-swap, which only one consumer of an item wins.
+ * The producer reads top before it reuses a slot, so a consumer has read
+ * its item by then. This is the steal of the C11 Chase-Lev deque of Le,
+ * Pop, Cohen and Zappa Nardelli, without the owner's pop, which assumes
+ * the pushing thread is the one that pops, and without the growing array.
+ */
+#include "csapp.h"
+#include "wsdeque.h"
+
+/* Make d an empty deque of at least n items */
+void wsdeque_init(wsdeque_t *d, int n) {
+  long size = 2;
+
+  while (size < n)
+    size *= 2;
+  d->items = Calloc(size, sizeof(int));
+  d->mask = size - 1;
+  d->top = d->bottom = 0;
+}
+
+/* Free the items of d */
+void wsdeque_deinit(wsdeque_t *d) { Free(d->items); }
+
+/* Producer: push item at the bottom unless d is full; returns 0 if it was */
+int wsdeque_push(wsdeque_t *d, int item) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+  if (b - t > d->mask)
+    return 0;
+  __atomic_store_n(&d->items[b & d->mask], item, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE); /* item before bottom */
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/*
+ * wsdeque_take - Take the first item of d into *item. Returns 1 on
+ * success, 0 if d was empty, and -1 if another consumer took the item
+ * first, in which case the caller may try again.
+ */
+int wsdeque_take(wsdeque_t *d, int *item) {
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  long b;
+  int x;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); /* top before bottom */
+  b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b)
+    return 0;
+  x = __atomic_load_n(&d->items[t & d->mask], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+                                   __ATOMIC_RELAXED))
+    return -1;
+  *item = x;
+  return 1;
+}
+
+/* Return the number of items in d; a hint while others use it */
+int wsdeque_count(wsdeque_t *d) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+  return b > t ? (int)(b - t) : 0;
+}
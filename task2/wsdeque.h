@@ -0,0 +1,40 @@
+/*
+ * wsdeque.h - Work-stealing deque of ints with one producer
+ *
+ * One thread, the producer, pushes at the bottom of the deque; any number
+ * of consumers, the worker it is dealt to and the thieves alike, take from
+ * the top, so the items come out in the order they were pushed. A push
+ * never contends with a take, and a take is one compare-and-swap on top,
+ * so top and bottom each stay in the cache of the side that writes them.
+ * The deque is bounded: a push onto a full deque fails and the producer
+ * must put the item elsewhere.
+ */
+#ifndef __WSDEQUE_H__
+#define __WSDEQUE_H__
+
+#define WSDEQUE_ALIGN 64 /* Top and bottom get a line each */
+
+typedef struct {
+  long top __attribute__((aligned(WSDEQUE_ALIGN)));    /* Next take */
+  long bottom __attribute__((aligned(WSDEQUE_ALIGN))); /* Next push */
+  int *items;                                          /* A power of two */
+  long mask;                                           /* Items - 1 */
+} wsdeque_t;
+
+/* Make d an empty deque of at least n items */
+void wsdeque_init(wsdeque_t *d, int n);
+
+/* Free the items of d */
+void wsdeque_deinit(wsdeque_t *d);
+
+/* Producer: push item at the bottom unless d is full; returns 0 if it was */
+int wsdeque_push(wsdeque_t *d, int item);
+
+/* Any consumer: take the first item into *item; returns 1 on success, 0
+   if d was empty, and -1 if another consumer took it first */
+int wsdeque_take(wsdeque_t *d, int *item);
+
+/* Return the number of items in d; a hint while others use it */
+int wsdeque_count(wsdeque_t *d);
+
+#endif /* __WSDEQUE_H__ */